@@ -25,6 +25,21 @@ static const char *voldowncmd[] = {"pactl", "set-sink-volume", "@DEFAULT_SINK@",
 static const char *volmutecmd[] = {"pactl", "set-sink-mute", "@DEFAULT_SINK@", "toggle", NULL};  // Mute volume
 static const char *brightnessupcmd[] = {"brightnessctl", "set", "+5%", NULL};  // Brightness up
 static const char *brightnessdowncmd[] = {"brightnessctl", "set", "5%-", NULL};  // Brightness down
+static const char *scratchpadcmd[] = {"alacritty", "--class", "scratchpad", NULL};  // Scratchpad terminal
+
+/* Window rules
+ * class/instance/role must match exactly, title is a substring match.
+ * workspace 0 keeps the current workspace; x/y/w/h place floating windows
+ * relative to the monitor, a 0x0 size keeps the window's own. freeze stops
+ * the application's processes with SIGSTOP while none of its windows is
+ * visible, for programs that keep animating on hidden workspaces. */
+static const Rule rules[] = {
+    /* class          instance  role      title  ws  float  full  x    y    w    h    freeze */
+    { "firefox",      NULL,     NULL,     NULL,  2,  0,     0,    0,   0,   0,   0,   0 },
+    { "firefox",      NULL,     "PictureInPicture", NULL, 0, 1, 0, 0, 0, 0, 0, 0 },
+    { "Pavucontrol",  NULL,     NULL,     NULL,  0,  1,     0,    200, 150, 800, 500, 0 },
+    { NULL,           NULL,     "pop-up", NULL,  0,  1,     0,    0,   0,   0,   0,   0 },
+};
 
 /* Static arguments for commands */
 static const char *const setmfact_dec[] = {"-0.05", NULL};
@@ -38,73 +53,93 @@ static const char *const workspace6[] = {"6", NULL};
 static const char *const workspace7[] = {"7", NULL};
 static const char *const workspace8[] = {"8", NULL};
 static const char *const workspace9[] = {"9", NULL};
+static const char *const monitor_next[] = {"+1", NULL};
+static const char *const monitor_prev[] = {"-1", NULL};
+static const char *const layout_tile[] = {"tile", NULL};
+static const char *const layout_monocle[] = {"monocle", NULL};
+static const char *const layout_grid[] = {"~/.local/lib/wm/grid.so", NULL};  /* Built from layouts/ */
 
-/* Key bindings structure */
+/* Key bindings structure
+ * repeat says what a held key does: RepeatIgnore runs the binding once per
+ * press, RepeatAllow on every auto-repeat, RepeatCoalesce folds the repeats
+ * waiting in the queue into one step of that many (focusnext, setmfact). */
 static const struct {
     unsigned int mod;
     KeySym keysym;
     void (*func)(const char **);
     const char *const *arg;  // Updated to maintain const correctness
+    int repeat;
 } keys[] = {
     /* Launchers */
-    { MODKEY, XK_p, spawn, roficmd },         // Open application launcher
-    { MODKEY, XK_w, spawn, firefoxcmd },      // Launch Firefox
-    { SMODKEY, XK_w, spawn, wifi_choosercmd }, // Open WiFi selector
-    { MODKEY, XK_c, spawn, digital_clockcmd }, // Launch digital clock
-    { MODKEY, XK_Return, spawn, alacrittycmd }, // Open terminal emulator
-    { SMODKEY, XK_s, spawn, powermenucmd },   // Open power menu
-    { CSMODKEY, XK_r, reload, NULL },          // Reload window manager
-    { SMODKEY, XK_r, reload_keys, NULL },    // Reload just key bindings
+    { MODKEY, XK_p, spawn, roficmd, RepeatIgnore },         // Open application launcher
+    { MODKEY, XK_w, spawn, firefoxcmd, RepeatIgnore },      // Launch Firefox
+    { SMODKEY, XK_w, spawn, wifi_choosercmd, RepeatIgnore }, // Open WiFi selector
+    { MODKEY, XK_c, spawn, digital_clockcmd, RepeatIgnore }, // Launch digital clock
+    { MODKEY, XK_Return, spawn, alacrittycmd, RepeatIgnore }, // Open terminal emulator
+    { SMODKEY, XK_s, spawn, powermenucmd, RepeatIgnore },   // Open power menu
+    { MODKEY, XK_grave, togglescratch, scratchpadcmd, RepeatIgnore }, // Show/hide scratchpad terminal
+    { CSMODKEY, XK_r, reload, NULL, RepeatIgnore },          // Reload window manager
+    { SMODKEY, XK_r, reload_keys, NULL, RepeatIgnore },    // Reload just key bindings
     
     /* Window control */
-    { MODKEY, XK_j, focusnext, NULL },        // Focus next window
-    { MODKEY, XK_k, focusprev, NULL },        // Focus previous window
-    { SMODKEY, XK_f, togglefullscreen, NULL }, // Toggle fullscreen
-    { SMODKEY, XK_c, killclient, NULL },      // Kill focused window
-    { SMODKEY, XK_q, quit, NULL },            // Quit window manager
+    { MODKEY, XK_j, focusnext, NULL, RepeatCoalesce },        // Focus next window
+    { MODKEY, XK_k, focusprev, NULL, RepeatCoalesce },        // Focus previous window
+    { SMODKEY, XK_f, togglefullscreen, NULL, RepeatIgnore }, // Toggle fullscreen
+    { SMODKEY, XK_c, killclient, NULL, RepeatIgnore },      // Kill focused window
+    { SMODKEY, XK_q, quit, NULL, RepeatIgnore },            // Quit window manager
     
     /* Layout control */
-    { MODKEY, XK_h, setmfact, setmfact_dec },  // Decrease master area
-    { MODKEY, XK_l, setmfact, setmfact_inc },  // Increase master area
-    { MODKEY, XK_space, togglefloating, NULL }, // Toggle floating layout
-    { SMODKEY, XK_Return, swapmaster, NULL }, // Swap focused window with master
+    { MODKEY, XK_h, setmfact, setmfact_dec, RepeatCoalesce },  // Decrease master area
+    { MODKEY, XK_l, setmfact, setmfact_inc, RepeatCoalesce },  // Increase master area
+    { MODKEY, XK_space, togglefloating, NULL, RepeatIgnore }, // Toggle floating layout
+    { SMODKEY, XK_Return, swapmaster, NULL, RepeatIgnore }, // Swap focused window with master
+    { MODKEY, XK_t, setlayout, layout_tile, RepeatIgnore },  // Master/stack layout for this workspace
+    { MODKEY, XK_m, setlayout, layout_monocle, RepeatIgnore }, // Monocle layout for this workspace
+    { MODKEY, XK_g, setlayout, layout_grid, RepeatIgnore },  // Grid layout plugin for this workspace
+    { CSMODKEY, XK_l, reloadlayouts, NULL, RepeatIgnore },   // Reload layout plugins
     
     /* System controls */
-    { 0, XF86XK_AudioRaiseVolume, spawn, volupcmd },        // Volume up
-    { 0, XF86XK_AudioLowerVolume, spawn, voldowncmd },      // Volume down
-    { 0, XF86XK_AudioMute, spawn, volmutecmd },             // Mute volume
-    { 0, XF86XK_MonBrightnessUp, spawn, brightnessupcmd },  // Brightness up
-    { 0, XF86XK_MonBrightnessDown, spawn, brightnessdowncmd }, // Brightness down
+    { 0, XF86XK_AudioRaiseVolume, spawn, volupcmd, RepeatAllow },        // Volume up
+    { 0, XF86XK_AudioLowerVolume, spawn, voldowncmd, RepeatAllow },      // Volume down
+    { 0, XF86XK_AudioMute, spawn, volmutecmd, RepeatIgnore },             // Mute volume
+    { 0, XF86XK_MonBrightnessUp, spawn, brightnessupcmd, RepeatAllow },  // Brightness up
+    { 0, XF86XK_MonBrightnessDown, spawn, brightnessdowncmd, RepeatAllow }, // Brightness down
     
     /* Workspace control */
-    { SMODKEY, XK_1, sendtoworkspace, workspace1 },      /* Move window to workspace 1 */
-    { MODKEY, XK_1, switchworkspace, workspace1 },     /* Switch to workspace 1 */
-    { CSMODKEY, XK_1, clearworkspace, workspace1 },     /* Clear workspace 1 */
-    { SMODKEY, XK_2, sendtoworkspace, workspace2 },      /* Move window to workspace 2 */
-    { MODKEY, XK_2, switchworkspace, workspace2 },     /* Switch to workspace 2 */
-    { CSMODKEY, XK_2, clearworkspace, workspace2 },     /* Clear workspace 2 */
-    { SMODKEY, XK_3, sendtoworkspace, workspace3 },      /* Move window to workspace 3 */
-    { MODKEY, XK_3, switchworkspace, workspace3 },     /* Switch to workspace 3 */
-    { CSMODKEY, XK_3, clearworkspace, workspace3 },      /* Move window to workspace 4 */
-    { SMODKEY, XK_4, sendtoworkspace, workspace4 },      /* Move window to workspace 4 */
-    { MODKEY, XK_4, switchworkspace, workspace4 },     /* Switch to workspace 4 */
-    { CSMODKEY, XK_4, clearworkspace, workspace4 },     /* Clear workspace 4 */
-    { SMODKEY, XK_5, sendtoworkspace, workspace5 },      /* Move window to workspace 5 */
-    { MODKEY, XK_5, switchworkspace, workspace5 },     /* Switch to workspace 5 */
-    { CSMODKEY, XK_5, clearworkspace, workspace5 },     /* Clear workspace 5 */
-    { SMODKEY, XK_6, sendtoworkspace, workspace6 },      /* Move window to workspace 6 */
-    { MODKEY, XK_6, switchworkspace, workspace6 },     /* Switch to workspace 6 */
-    { CSMODKEY, XK_6, clearworkspace, workspace6 },     /* Clear workspace 6 */
-    { SMODKEY, XK_7, sendtoworkspace, workspace7 },      /* Move window to workspace 7 */
-    { MODKEY, XK_7, switchworkspace, workspace7 },     /* Switch to workspace 7 */
-    { CSMODKEY, XK_7, clearworkspace, workspace7 },     /* Clear workspace 7 */
-    { SMODKEY, XK_8, sendtoworkspace, workspace8 },      /* Move window to workspace 8 */
-    { MODKEY, XK_8, switchworkspace, workspace8 },     /* Switch to workspace 8 */
-    { CSMODKEY, XK_8, clearworkspace, workspace8 },     /* Clear workspace 8 */
-    { SMODKEY, XK_9, sendtoworkspace, workspace9 },      /* Move window to workspace 9 */
-    { MODKEY, XK_9, switchworkspace, workspace9 },     /* Switch to workspace 9 */    
-    { CSMODKEY, XK_9, clearworkspace, workspace9 },     /* Clear workspace 9 */
-    { MODKEY, XK_Escape, showworkspace, NULL },  /* Show current workspace number */
+    { SMODKEY, XK_1, sendtoworkspace, workspace1, RepeatIgnore },      /* Move window to workspace 1 */
+    { MODKEY, XK_1, switchworkspace, workspace1, RepeatIgnore },     /* Switch to workspace 1 */
+    { CSMODKEY, XK_1, clearworkspace, workspace1, RepeatIgnore },     /* Clear workspace 1 */
+    { SMODKEY, XK_2, sendtoworkspace, workspace2, RepeatIgnore },      /* Move window to workspace 2 */
+    { MODKEY, XK_2, switchworkspace, workspace2, RepeatIgnore },     /* Switch to workspace 2 */
+    { CSMODKEY, XK_2, clearworkspace, workspace2, RepeatIgnore },     /* Clear workspace 2 */
+    { SMODKEY, XK_3, sendtoworkspace, workspace3, RepeatIgnore },      /* Move window to workspace 3 */
+    { MODKEY, XK_3, switchworkspace, workspace3, RepeatIgnore },     /* Switch to workspace 3 */
+    { CSMODKEY, XK_3, clearworkspace, workspace3, RepeatIgnore },      /* Move window to workspace 4 */
+    { SMODKEY, XK_4, sendtoworkspace, workspace4, RepeatIgnore },      /* Move window to workspace 4 */
+    { MODKEY, XK_4, switchworkspace, workspace4, RepeatIgnore },     /* Switch to workspace 4 */
+    { CSMODKEY, XK_4, clearworkspace, workspace4, RepeatIgnore },     /* Clear workspace 4 */
+    { SMODKEY, XK_5, sendtoworkspace, workspace5, RepeatIgnore },      /* Move window to workspace 5 */
+    { MODKEY, XK_5, switchworkspace, workspace5, RepeatIgnore },     /* Switch to workspace 5 */
+    { CSMODKEY, XK_5, clearworkspace, workspace5, RepeatIgnore },     /* Clear workspace 5 */
+    { SMODKEY, XK_6, sendtoworkspace, workspace6, RepeatIgnore },      /* Move window to workspace 6 */
+    { MODKEY, XK_6, switchworkspace, workspace6, RepeatIgnore },     /* Switch to workspace 6 */
+    { CSMODKEY, XK_6, clearworkspace, workspace6, RepeatIgnore },     /* Clear workspace 6 */
+    { SMODKEY, XK_7, sendtoworkspace, workspace7, RepeatIgnore },      /* Move window to workspace 7 */
+    { MODKEY, XK_7, switchworkspace, workspace7, RepeatIgnore },     /* Switch to workspace 7 */
+    { CSMODKEY, XK_7, clearworkspace, workspace7, RepeatIgnore },     /* Clear workspace 7 */
+    { SMODKEY, XK_8, sendtoworkspace, workspace8, RepeatIgnore },      /* Move window to workspace 8 */
+    { MODKEY, XK_8, switchworkspace, workspace8, RepeatIgnore },     /* Switch to workspace 8 */
+    { CSMODKEY, XK_8, clearworkspace, workspace8, RepeatIgnore },     /* Clear workspace 8 */
+    { SMODKEY, XK_9, sendtoworkspace, workspace9, RepeatIgnore },      /* Move window to workspace 9 */
+    { MODKEY, XK_9, switchworkspace, workspace9, RepeatIgnore },     /* Switch to workspace 9 */    
+    { CSMODKEY, XK_9, clearworkspace, workspace9, RepeatIgnore },     /* Clear workspace 9 */
+    { MODKEY, XK_Escape, showworkspace, NULL, RepeatIgnore },  /* Show current workspace number */
+
+    /* Monitor control */
+    { MODKEY, XK_period, focusmon, monitor_next, RepeatIgnore },   /* Focus next monitor */
+    { MODKEY, XK_comma, focusmon, monitor_prev, RepeatIgnore },    /* Focus previous monitor */
+    { SMODKEY, XK_period, sendtomon, monitor_next, RepeatIgnore }, /* Move window to next monitor */
+    { SMODKEY, XK_comma, sendtomon, monitor_prev, RepeatIgnore },  /* Move window to previous monitor */
 };
 
 /* Window manager settings */
@@ -114,4 +149,44 @@ static const struct {
 #define MAX_WINDOWS   5     /* Window limit per workspace*/
 #define GAP_WIDTH     5    /* Gap between windows */
 
+/* Scratchpad */
+#define SCRATCHPAD_CLASS     "scratchpad" /* WM_CLASS instance or class of the scratchpad */
+#define SCRATCHPAD_WIDTH     0.6          /* Width relative to the monitor */
+#define SCRATCHPAD_HEIGHT    0.5          /* Height relative to the monitor */
+#define SCRATCHPAD_PRELAUNCH 1            /* Launch hidden at startup */
+
+/* Selection manager (needs XFixes) */
+#define CLIPBOARD_MAX_BYTES  (16 << 20)   /* Larger selections are left to their owner */
+
+/* X server resource accounting (needs the X-Resource extension) */
+#define XRES_INTERVAL_S      60           /* Seconds between samples, 0 samples only on SIGUSR1 */
+
+/* Redraw-rate monitor (needs the Damage extension) */
+#define DAMAGE_MONITOR        0           /* Track repaints of managed windows, opt-in */
+#define DAMAGE_VISIBLE_WEIGHT 4           /* Cost of uncovered repaints relative to covered ones */
+#define DAMAGE_IDLE_S         120         /* User counts as idle after this long (needs XScreenSaver) */
+#define DAMAGE_FLAG_S         10          /* Log windows repainting unseen this many seconds in a row */
+
+/* Status bar */
+#define BAR                  0            /* Draw workspaces and the focused title at the top */
+#define BAR_FONT             "fixed"      /* Core X font, ASCII is drawn */
+#define BAR_FG               0xf8f8f2
+#define BAR_BG               0x282a36
+#define BAR_SEL_FG           0x282a36     /* Shown workspace */
+#define BAR_SEL_BG           0xbd93f9
+
+/* Session, saved to ~/.local/share/wm/session */
+#define SESSION_SAVE_DELAY_S      5       /* Save this long after a change, 0 disables saving */
+#define SESSION_RESTORE           1       /* Relaunch the saved session when starting without windows */
+#define SESSION_RESTORE_TIMEOUT_S 30      /* Lay out what came back after this long */
+
+/* Event loop */
+#define INPUT_PRIORITY_DEPTH 8            /* Run keys and buttons first once this many events queue, 0 never */
+#define WATCHDOG_BUDGET_MS   250          /* Log a backtrace of handlers slower than this, 0 disables */
+
+/* Workspace cgroups (cgroup v2, needs a delegated cgroup such as a systemd user unit) */
+#define CGROUP_WORKSPACES    1            /* Run spawned commands in a cgroup per workspace */
+#define CGROUP_ACTIVE_WEIGHT 1000         /* cpu.weight and io.weight of shown workspaces */
+#define CGROUP_IDLE_WEIGHT   100          /* Weight of hidden workspaces */
+
 #endif /* CONFIG_H */
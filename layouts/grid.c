@@ -0,0 +1,27 @@
+/* Grid layout plugin: windows in rows and columns of equal size */
+#include "wmlayout.h"
+
+static void
+arrange(const WMLayoutParams *p, WMRect *out)
+{
+    int cols = 1, rows, i;
+
+    while (cols * cols < p->n)
+        cols++;
+    rows = (p->n + cols - 1) / cols;
+
+    for (i = 0; i < p->n; i++) {
+        int row = i / cols, col = i % cols;
+        /* The last row shares its width among fewer windows */
+        int inrow = row == rows - 1 ? p->n - row * cols : cols;
+        int cw = (p->area.w - p->gap) / inrow;
+        int ch = (p->area.h - p->gap) / rows;
+
+        out[i].x = p->area.x + p->gap + col * cw;
+        out[i].y = p->area.y + p->gap + row * ch;
+        out[i].w = cw - p->gap - 2 * p->border;
+        out[i].h = ch - p->gap - 2 * p->border;
+    }
+}
+
+const WMLayout wm_layout = { WMLAYOUT_ABI, "grid", arrange };
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Profile-guided, link-time optimized build of wm, run by "make pgo".
+#
+# The event traces in pgo/traces are replayed under Xvfb by an instrumented
+# build, then wm is rebuilt with -fprofile-use -flto. Without traces, the
+# scripted sessions of pgo/record.sh are recorded first; traces of real
+# sessions (WM_TRACE, see README) can be dropped in next to them. The
+# handler latency per event type of the plain and the optimized build,
+# replaying the same traces, is printed at the end.
+set -e
+cd "$(dirname "$0")/.."
+
+command -v Xvfb >/dev/null || { echo "pgo.sh: Xvfb is needed" >&2; exit 1; }
+
+WORK=$(mktemp -d)
+XVFB=
+trap '[ -n "$XVFB" ] && kill $XVFB 2>/dev/null; rm -rf "$WORK"' EXIT INT TERM
+
+# A private server and home, so the log, stats and cgroups of the running
+# session are left alone
+export DISPLAY=${PGO_DISPLAY:-:97} HOME="$WORK" WM_NO_CGROUPS=1
+mkdir -p "$HOME/.local/share"
+Xvfb "$DISPLAY" -screen 0 1920x1080x24 -nolisten tcp >/dev/null 2>&1 &
+XVFB=$!
+sleep 1
+
+# Sum the replay reports of all traces: events, avg_us, max_us per event type
+replayall() {
+    for t in pgo/traces/*.trace; do
+        ./wm -r "$t"
+    done | awk '$2 ~ /^[0-9]+$/ && NF >= 5 && $1 != "event" {
+        n[$1] += $2; t[$1] += $2 * $3; if ($4 > m[$1]) m[$1] = $4
+    } END {
+        for (e in n) printf "%s %d %.1f %.1f\n", e, n[e], t[e] / n[e], m[e]
+    }' | sort > "$1"
+}
+
+echo "== plain build"
+make clean >/dev/null
+make wm
+ls pgo/traces/*.trace >/dev/null 2>&1 || ./pgo/record.sh
+replayall "$WORK/before"
+
+echo "== instrumented build"
+rm -rf pgo/profile
+make clean >/dev/null
+make wm PGO=gen
+replayall /dev/null
+
+echo "== optimized build"
+make clean >/dev/null
+make wm PGO=use
+replayall "$WORK/after"
+
+echo
+join "$WORK/before" "$WORK/after" | awk '
+    BEGIN { printf "%-18s %9s %11s %10s %11s %10s %7s\n", "event", "events",
+            "before_avg", "after_avg", "before_max", "after_max", "change" }
+    { printf "%-18s %9d %11.1f %10.1f %11.1f %10.1f %6.1f%%\n", $1, $2, $3, $6, $4, $7,
+             $3 > 0 ? ($6 - $3) * 100 / $3 : 0 }'
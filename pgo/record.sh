@@ -0,0 +1,89 @@
+#!/bin/sh
+# Record the scripted training sessions of pgo.sh into pgo/traces: window
+# churn, drags, workspace switching and held keys. Runs ./wm on $DISPLAY,
+# which should be a scratch server such as Xvfb, and drives it with
+# xdotool and a simple X client.
+set -e
+cd "$(dirname "$0")/.."
+
+command -v xdotool >/dev/null || { echo "record.sh: xdotool is needed" >&2; exit 1; }
+for client in xterm xlogo xeyes xclock ""; do
+    [ -n "$client" ] && command -v "$client" >/dev/null && break
+done
+[ -n "$client" ] || { echo "record.sh: one of xterm, xlogo, xeyes or xclock is needed" >&2; exit 1; }
+mkdir -p pgo/traces
+
+pids=
+open() {
+    for i in $(seq "$1"); do
+        "$client" >/dev/null 2>&1 &
+        pids="$pids $!"
+    done
+    sleep 1
+}
+
+# session name function: record one trace, quitting with Super+Shift+q
+session() {
+    WM_TRACE="pgo/traces/$1.trace" ./wm &
+    wm=$!
+    sleep 1
+    "$2"
+    xdotool key super+shift+q
+    wait $wm || true
+    kill $pids 2>/dev/null || true
+    pids=
+    echo "recorded pgo/traces/$1.trace"
+}
+
+churn() {
+    for round in $(seq 10); do
+        open 4
+        for i in $(seq 4); do
+            xdotool key super+shift+c
+            sleep 0.1
+        done
+    done
+}
+
+drags() {
+    open 3
+    xdotool key super+space      # Float the focused window
+    for i in $(seq 10); do
+        xdotool mousemove 400 300 keydown super mousedown 1
+        for x in 500 700 900 1100 900 700; do
+            xdotool mousemove "$x" 400
+            sleep 0.02
+        done
+        xdotool mouseup 1 keyup super
+        # Drop onto another tiled window to swap
+        xdotool mousemove 1500 300 keydown super mousedown 1 mousemove 300 500 mouseup 1 keyup super
+    done
+}
+
+workspaces() {
+    for ws in 1 2 3 4; do
+        xdotool key "super+$ws"
+        open 2
+    done
+    for round in $(seq 20); do
+        for ws in 1 2 3 4 3 2; do
+            xdotool key "super+$ws"
+            sleep 0.05
+        done
+    done
+}
+
+repeats() {
+    xset r on 2>/dev/null || true
+    open 4
+    for key in j k l h; do
+        xdotool keydown "super+$key"
+        sleep 2
+        xdotool keyup "super+$key"
+    done
+}
+
+session churn churn
+session drags drags
+session workspaces workspaces
+session repeats repeats
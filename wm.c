@@ -3,17 +3,65 @@
 #include <X11/XKBlib.h>
 #include <X11/Xproto.h>
 #include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#ifdef XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+#ifdef XFIXES
+#include <X11/extensions/Xfixes.h>
+#endif
+#ifdef XDAMAGE
+#include <X11/extensions/Xdamage.h>
+#ifdef XSS
+#include <X11/extensions/scrnsaver.h>
+#endif
+#include <sys/timerfd.h>
+#endif
+#ifdef XRES
+#include <xcb/res.h>
+#include <sys/timerfd.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <time.h>
 #include <stdarg.h>
 #include <linux/limits.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <execinfo.h>
+#ifdef USDT
+#include <sys/sdt.h>
+#endif
+
+#include "wmstate.h"
+#include "wmtrace.h"
+#include "wmlayout.h"
 
 /* Type definitions - must come before function declarations */
+typedef struct Monitor Monitor;
+
+/* A built-in or dlopen()ed layout, shared by the workspaces using it */
+typedef struct Layout {
+    const WMLayout *l;
+    void *handle;               /* NULL for built-in layouts */
+    char path[PATH_MAX];
+    int refs;                   /* Workspaces using it */
+    struct Layout *next;
+    int monocle;                /* Only the focused tiled window stays mapped */
+} Layout;
+
 typedef struct Client {
     Window win;
     int x, y, w, h;
@@ -21,14 +69,119 @@ typedef struct Client {
     int isfloating;
     int workspace;
     int isfullscreen;
+    Monitor *mon;               /* Output the client lives on */
+    char class[64];             /* WM_CLASS class */
+    char instance[64];          /* WM_CLASS instance */
+    char role[64];              /* WM_WINDOW_ROLE */
+    char title[256];            /* _NET_WM_NAME or WM_NAME */
+    pid_t pid;                  /* _NET_WM_PID, 0 if unknown */
+    Window transientfor;        /* WM_TRANSIENT_FOR, None if not a transient */
+    Atom wtype;                 /* First _NET_WM_WINDOW_TYPE, None if unset */
+    struct Client *parent;      /* Managed client this one is transient for */
+    struct Client *transients;  /* First transient of this client */
+    struct Client *tnext;       /* Next sibling in the parent's transients */
+    int freeze;                 /* Stop the process while the window is hidden */
+    int frozen;                 /* Process currently stopped for this window */
+    int basew, baseh, incw, inch;   /* WM_NORMAL_HINTS, 0 where unset */
+    int minw, minh, maxw, maxh;
+    float mina, maxa;           /* Aspect limits as height/width and width/height */
+    int placed;                 /* Position chosen by a rule, parent or scratchpad */
+    unsigned long raised;       /* Focus sequence number, approximates stacking */
+    int ix, iy, iw, ih, iws;    /* Rectangle and workspace in the spatial index */
+    int indexed;
+    int hidden;                 /* Unmapped by monocle although its workspace is shown */
+    int titlestale;             /* Title changed since it was read */
+    int held;                   /* Restored from the session, unmapped until restoredone() */
+    unsigned long xresbytes;    /* Pixmap bytes of the X client, charged to its first window */
+    unsigned int xreswindows;   /* Windows of the X client, same */
+    unsigned long damage;       /* Damage object while the redraw monitor runs */
+    unsigned int dmgevents;     /* Repaints and pixels in the current second */
+    unsigned long dmgpixels;
+    double dmgrate, dmgpxrate;  /* Repaints and pixels per second, averaged */
+    double dmgcost;             /* Pixel rate, weighted up on shown workspaces */
+    unsigned int dmgstreak;     /* Consecutive seconds repainting unseen */
+    unsigned int dmgunseen[2];  /* Seconds repainting while idle, occluded */
 } Client;
 
+/* What a segment of the status bar shows, to skip redrawing it */
+typedef struct {
+    char text[256];
+    int selected;
+    int valid;
+} BarSeg;
+#define BARSEGS 10              /* Workspaces 1-9 and the focused title */
+
+/* One per RandR output, each with its own workspaces and master ratio */
+struct Monitor {
+    int num;
+    int mx, my, mw, mh;         /* Output geometry */
+    int wx, wy, ww, wh;         /* Work area handed to the layout */
+    int workspace;              /* Workspace shown on this output (1-9) */
+    float mfact;                /* Master area size ratio (0.1-0.9) */
+    Layout *lt[10];             /* Layout of each workspace (1-9) */
+    int dirty;                  /* Geometry changed since the last layout */
+    Window barwin;              /* Status bar, None without BAR */
+    Pixmap barpix;              /* Bar contents, also its background */
+    BarSeg seg[BARSEGS];
+    Monitor *next;
+};
+
+/* Window rule, NULL strings match anything */
+typedef struct {
+    const char *class;
+    const char *instance;
+    const char *role;
+    const char *title;          /* Substring of the window title */
+    int workspace;              /* 1-9, 0 keeps the current workspace */
+    int isfloating;
+    int isfullscreen;
+    int x, y, w, h;             /* Floating geometry within the monitor, 0x0 keeps the window's own */
+    int freeze;                 /* SIGSTOP the process while its workspace is hidden */
+} Rule;
+
+/* Atoms interned once at startup */
+enum { WMWindowRole, WMStateProp, NetWMName, NetWMWindowType, NetWMPid,
+       NetWMState, NetWMStateHidden, NetWMStateFullscreen, NetWMWindowTypeDialog, NetWMWindowTypeUtility, NetWMWindowTypeSplash,
+       NetWMWindowTypeToolbar,
+       WMWindows, WMWorkspaces, WMWindowStates, WMMonitors, WMMonitorWorkspaces,
+       UTF8String, Targets, Incr, Timestamp, Text,
+       AtomLast };
+
+/* Window properties read in one pipelined batch */
+enum { PropClass, PropRole, PropNetName, PropName, PropPid, PropTransient,
+       PropType, PropNormalHints, PropLast };
+
+typedef struct {
+    xcb_get_property_cookie_t prop[PropLast];
+} PropRequest;
+
+/* USDT probes, provider "wm", for perf and bpftrace. Each is a nop until
+ * a tracer attaches; without sys/sdt.h they compile to nothing. */
+#ifdef USDT
+#define PROBE1(n, a)          DTRACE_PROBE1(wm, n, a)
+#define PROBE2(n, a, b)       DTRACE_PROBE2(wm, n, a, b)
+#define PROBE3(n, a, b, c)    DTRACE_PROBE3(wm, n, a, b, c)
+#else
+#define PROBE1(n, a)          do { } while (0)
+#define PROBE2(n, a, b)       do { } while (0)
+#define PROBE3(n, a, b, c)    do { } while (0)
+#endif
+
+/* What a held key binding does on auto-repeat, see keys[] */
+enum { RepeatIgnore, RepeatAllow, RepeatCoalesce };
+
+#define ISVISIBLE(C)  ((C)->workspace == (C)->mon->workspace && !(C)->held)
+#define MAXMONITORS   WMSTATE_MONITORS
+#define RULEBUCKETS   64
+
 /* Function declarations */
 void cleanup(void);
+extern char **environ;
 
 /* Forward declarations */
 static void maprequest(XEvent *e);
 static void keypress(XEvent *e);
+static void keyrelease(XEvent *e);
 static void destroynotify(XEvent *e);
 static void configurerequest(XEvent *e);
 static void focusnext(const char **);
@@ -38,7 +191,8 @@ static void setmfact(const char **);
 static void togglefloating(const char **);
 static void quit(const char **);
 static void focus(Client *c);
-static void arrange(void);
+static void arrange(Monitor *m);
+static void applylayout(Monitor *m);
 static void swapmaster(const char **);
 static void sendtoworkspace(const char **);
 static void switchworkspace(const char **);
@@ -52,6 +206,37 @@ static void enternotify(XEvent *e);
 static void buttonpress(XEvent *e);
 static void buttonrelease(XEvent *e);
 static void motionnotify(XEvent *e);
+static void configurenotify(XEvent *e);
+static void propertynotify(XEvent *e);
+static void focusmon(const char **);
+static void sendtomon(const char **);
+static void procmapped(Client *c);
+static void togglescratch(const char **);
+static void setlayout(const char **);
+static void reloadlayouts(const char **);
+static void setvisible(Client *c, int visible);
+static void setwinstate(Client *c, int visible);
+static void cgroupmove(Client *c);
+static void resize(Client *c, int x, int y, int w, int h);
+static void spatialreset(void);
+static void sethidden(Client *c, int hidden);
+static void updatetitle(Client *c);
+static void watchdetail(unsigned long detail);
+static long long now_ns(void);
+static void sessionchanged(void);
+static void sessionclaim(Client *c);
+static void sessionrelease(Client *c);
+static void restoredone(void);
+static void sessionsave(void);
+#ifdef XFIXES
+static void clipcancel(Window w);
+static void selectionrequest(XEvent *e);
+static void selectionclear(XEvent *e);
+static void selectionnotify(XEvent *e);
+#endif
+static void updateweights(void);
+static void thawall(void);
+static const char *eventname(int type);
 
 #include "config.h"
 
@@ -65,8 +250,10 @@ wm_log(const char *fmt, ...) {
         return;
 
     time_t t = time(NULL);
-    struct tm *tm = localtime(&t);
-    fprintf(logfile, "[%02d:%02d:%02d] ", tm->tm_hour, tm->tm_min, tm->tm_sec);
+    struct tm tm;
+    localtime_r(&t, &tm);  /* The watchdog thread logs too */
+    flockfile(logfile);
+    fprintf(logfile, "[%02d:%02d:%02d] ", tm.tm_hour, tm.tm_min, tm.tm_sec);
 
     va_list ap;
     va_start(ap, fmt);
@@ -74,6 +261,7 @@ wm_log(const char *fmt, ...) {
     va_end(ap);
 
     fflush(logfile);
+    funlockfile(logfile);
 }
 
 /* Error handler */
@@ -89,6 +277,14 @@ xerror(Display *dpy __attribute__((unused)), XErrorEvent *ee) {
     return 0;
 }
 
+static double
+elapsed_ms(const struct timespec *t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
 /* Window Manager Global State */
 static Display *dpy;                // X11 display connection
 static Window root;                 // Root window handle
@@ -96,51 +292,1013 @@ static int screen;                 // Current screen number
 static XWindowAttributes attr;      // Root window attributes
 static int running = 1;            // Main loop control flag
 static Client *clients = NULL;      // Linked list of managed windows
+static int nclients = 0;            // Length of clients
 static Client *sel = NULL;         // Currently selected window
-static float mfact = MASTER_SIZE;  // Master area size ratio (0.1-0.9)
-static int current_workspace = 1;  /* Current workspace (1-based index) */
-// Add these new globals
-static Atom clipboard;
-static Atom primary_selection;
+static Monitor *mons = NULL;        // List of outputs
+static Monitor *selmon = NULL;      // Output that has the focus
+#ifdef XRANDR
+static int xrandr = 0;             // RandR 1.3 available
+static int rrevbase = 0;           // RandR event base
+#endif
+#ifdef XFIXES
+static int xfixes = 0;             // XFixes available, selection manager on
+static int xfixesevbase = 0;       // XFixes event base
+#endif
+#ifdef XDAMAGE
+static int damagemon = 0;          // Redraw monitor running, see DAMAGE_MONITOR
+static int damageevbase = 0;       // Damage event base
+#endif
+#ifdef XRES
+static int xres = 0;               // X-Resource available, 1.2 adds client PIDs
+static int xresminor = 0;
+typedef struct {
+    XID base, mask;             /* Resource id range of the X client */
+    pid_t pid;                  /* 0 if unknown */
+    unsigned long bytes;        /* Pixmap bytes */
+    unsigned long prevbytes;    /* Pixmap bytes at the previous sample */
+    unsigned int windows, pixmaps;
+    Window win;                 /* First managed window, None if unmanaged */
+} XResUsage;
+
+static XResUsage *xresusage = NULL;     /* Sorted by pixmap bytes, largest first */
+static int nxresusage = 0;
+static Atom xreswindow, xrespixmap;
+static int xrestimer = -1;              /* timerfd driving the samples */
+static unsigned long xressamples = 0;
+static double xresms = 0;               /* Duration of the last sample */
+#endif
+static Atom clipboard;              // CLIPBOARD and PRIMARY, kept by the
+static Atom primary_selection;      // selection manager when XFixes is there
 static int dragx, dragy;           // Initial cursor position
+static int dragnx, dragny;         // Where the dragged window was last moved
 static Client *dragclient = NULL;  // Window being dragged
 static int drag_started = 0;       // Track if drag has started
+static Atom atom[AtomLast];        // Interned atoms, see atomnames
+static const char *atomnames[AtomLast] = {
+    [WMWindowRole] = "WM_WINDOW_ROLE",
+    [WMStateProp] = "WM_STATE",
+    [NetWMName] = "_NET_WM_NAME",
+    [NetWMWindowType] = "_NET_WM_WINDOW_TYPE",
+    [NetWMPid] = "_NET_WM_PID",
+    [NetWMState] = "_NET_WM_STATE",
+    [NetWMStateHidden] = "_NET_WM_STATE_HIDDEN",
+    [NetWMStateFullscreen] = "_NET_WM_STATE_FULLSCREEN",
+    [NetWMWindowTypeDialog] = "_NET_WM_WINDOW_TYPE_DIALOG",
+    [NetWMWindowTypeUtility] = "_NET_WM_WINDOW_TYPE_UTILITY",
+    [NetWMWindowTypeSplash] = "_NET_WM_WINDOW_TYPE_SPLASH",
+    [NetWMWindowTypeToolbar] = "_NET_WM_WINDOW_TYPE_TOOLBAR",
+    [WMWindows] = "_WM_WINDOWS",
+    [WMWorkspaces] = "_WM_WORKSPACES",
+    [WMWindowStates] = "_WM_WINDOW_STATES",
+    [WMMonitors] = "_WM_MONITORS",
+    [WMMonitorWorkspaces] = "_WM_MONITOR_WORKSPACES",
+    [UTF8String] = "UTF8_STRING",
+    [Targets] = "TARGETS",
+    [Incr] = "INCR",
+    [Timestamp] = "TIMESTAMP",
+    [Text] = "TEXT",
+};
+static xcb_connection_t *xc = NULL; // xcb side of dpy, for pipelined reads
+static WMState *statepage = NULL;  // Shared-memory state page for readers
+static int sigfd = -1;             // signalfd for SIGCHLD and SIGUSR1
+static char statspath[512];        // Where writestats() reports
+static char sessionpath[512];      // Session saved for the next start, see sessionsave()
+static long long sessiondue = 0;   // When to save the session, 0 if nothing changed
+static char *sessionlast = NULL;   // What was saved last, identical saves are skipped
+static size_t sessionlastlen = 0;
+static Client *scratch = NULL;     // Scratchpad window, workspace 0 while hidden
+static int scratchlaunched = 0;    // Scratchpad command spawned, window not yet seen
+static int scratchshow = 0;        // Show the scratchpad as soon as it maps
+static char statename[64];         // shm object name of the state page
+static FILE *tracefp = NULL;       // Event trace being recorded, see wmtrace.h
+static struct timespec tracestart; // Start of this instance's recording
+static uint64_t tracebase = 0;     // Trace time at tracestart, earlier instances come first
+static int replaying = 0;          // Events come from a trace, not the server
+static unsigned int xcnext = 0;    // Request after the last one sent straight through xcb
+
+/* Time and requests spent per event type, the last slot is extension events */
+typedef struct {
+    unsigned long events, requests;
+    double total_ms, max_ms;
+} HandlerStat;
+static HandlerStat hstats[LASTEvent + 1];
+
+/* Window of the saved session waiting for its application, see restoresession() */
+typedef struct {
+    Window win;                 /* Window matched to the slot, None while waiting */
+    int workspace, mon, isfloating;
+    int x, y, w, h;             /* Geometry of floating windows */
+    pid_t pid;                  /* Process at save time, windows of one process launch once */
+    pid_t launched;             /* Process started for it */
+    char class[64], instance[64];
+} Slot;
+static Slot *slots = NULL;
+static int nslots = 0;
+static int restoreleft = 0;        // Slots without a window while restoring
+static long long restoreend = 0;   // Give up waiting for the rest, 0 when not restoring
+static struct timespec restorestart;
+
+/* Stall watchdog breadcrumb and counters, see watchbegin() */
+static const double stallms[] = { 16, 100, 1000 };
+#define NSTALL (sizeof(stallms) / sizeof(stallms[0]))
+
+static struct {
+    unsigned long seq;          /* Odd while a handler runs */
+    long long start_ns;         /* CLOCK_MONOTONIC when it started */
+    const char *name;
+    int type;
+    unsigned long detail;       /* Keysym of key bindings, 0 otherwise */
+} crumb;
+static unsigned long stalls[NSTALL];
+static struct {
+    long minute;
+    unsigned int n[NSTALL];
+} stallring[60];
+static pthread_t mainthread;
+static unsigned long reportedseq = 0;  /* Written by the watchdog thread */
+
+/* Events received per selecting mask or grab, to keep the subscriptions honest */
+enum { MaskKeyGrab, MaskButtonGrab, MaskDragGrab, MaskEnterWindow,
+       MaskSubstructureRedirect, MaskSubstructureNotify, MaskStructureNotify,
+       MaskPropertyChange, MaskExtension, MaskOther, MaskLast };
+static const char *masknames[MaskLast] = {
+    [MaskKeyGrab] = "key grabs", [MaskButtonGrab] = "button grabs",
+    [MaskDragGrab] = "drag grab", [MaskEnterWindow] = "EnterWindow",
+    [MaskSubstructureRedirect] = "SubstructureRedirect",
+    [MaskSubstructureNotify] = "SubstructureNotify",
+    [MaskStructureNotify] = "StructureNotify",
+    [MaskPropertyChange] = "PropertyChange", [MaskExtension] = "extensions",
+    [MaskOther] = "other",
+};
+static unsigned long maskevents[MaskLast];
+static unsigned long unboundkeys = 0;  // Key events that matched no binding
+static unsigned int heldkey = 0;       // Keycode pressed and not released, 0 if none
+static int keysteps = 1;               // Presses coalesced into the running binding
+static unsigned long repeatsignored = 0, repeatscoalesced = 0;
+static unsigned long wakeups = 0;      // Event loop iterations woken by the server
+
+/* Event queue scheduling, see dispatchpending() */
+typedef struct {
+    int type;                   /* 0 if the slot is free */
+    Window win;
+    unsigned long detail;       /* Atom or value mask */
+    unsigned int left;          /* Instances still queued */
+} Pending;
+#define PENDINGSLOTS 256
+static Pending pending[PENDINGSLOTS];
+static unsigned long qdepth[5];        // Batches by queue depth: 1, 2-7, 8-31, 32-127, 128+
+static int qdepthmax = 0;
+static unsigned long inputevents = 0;  // Key and button events, and how long they waited
+static long long inputwait_ns = 0, inputwaitmax_ns = 0;
+static unsigned long inputearly = 0, inputovertook = 0; // Run ahead of how many queued events
+static unsigned long coalesced[LASTEvent]; // Events dropped for a later one of the same kind
+static struct timespec starttime;
 
 /* Event handler mapping table */
 static void (*handler[LASTEvent]) (XEvent *) = {
     [MapRequest] = maprequest,      // Handle new window creation
     [KeyPress] = keypress,          // Handle keyboard input
+    [KeyRelease] = keyrelease,      // Ends auto-repeat of a held key
     [DestroyNotify] = destroynotify, // Handle window destruction
     [ConfigureRequest] = configurerequest, // Handle window resize/move requests
     [EnterNotify] = enternotify,    // Handle mouse enter events
     [ButtonPress] = buttonpress,
     [ButtonRelease] = buttonrelease,
     [MotionNotify] = motionnotify,
+    [ConfigureNotify] = configurenotify, // Handle root window resizes
+    [PropertyNotify] = propertynotify, // Track size hints
+#ifdef XFIXES
+    [SelectionRequest] = selectionrequest, // Pastes served from the cache
+    [SelectionClear] = selectionclear,
+    [SelectionNotify] = selectionnotify,
+#endif
 };
 
-/* Helper function to count windows in a workspace */
+/* Helper function to count windows in a workspace of a monitor */
 static int
-count_windows_in_workspace(int workspace)
+count_windows_in_workspace(Monitor *m, int workspace)
 {
     Client *c;
     int count = 0;
     for (c = clients; c; c = c->next)
-        if (c->workspace == workspace)
+        if (c->mon == m && c->workspace == workspace)
             count++;
     return count;
 }
 
 /* Add this helper function after the other static declarations */
 static Client *
-find_fullscreen(void)
+find_fullscreen(Monitor *m)
+{
+    Client *c;
+    for (c = clients; c; c = c->next)
+        if (c->isfullscreen && c->mon == m && ISVISIBLE(c))
+            return c;
+    return NULL;
+}
+
+/* Status bar
+ * Each monitor gets an override-redirect window whose background is a
+ * pixmap holding the whole bar, so the server repaints exposures itself.
+ * Text is copied from an atlas of the printable ASCII glyphs, rendered
+ * once at startup in the normal and selected colors. A segment (one per
+ * workspace, plus the focused title) is redrawn only when what it shows
+ * changed, from publishstate() or a title change of the focused window. */
+#define BARWSCHARS 5               /* " 1:3 " */
+
+static Pixmap baratlas = None;
+static GC bargc;
+static int barcw, barch;           /* Glyph cell in the atlas */
+static int barh = 0;               /* Bar height, 0 without a bar */
+static unsigned long barredraws = 0;
+
+static void
+setupbar(void)
+{
+    static const unsigned long fg[2] = { BAR_FG, BAR_SEL_FG }, bg[2] = { BAR_BG, BAR_SEL_BG };
+    XFontStruct *font;
+    XGCValues gcv;
+    char glyph;
+
+    if (!BAR)
+        return;
+    if (!(font = XLoadQueryFont(dpy, BAR_FONT)) && !(font = XLoadQueryFont(dpy, "fixed"))) {
+        wm_log("Cannot load a font for the bar\n");
+        return;
+    }
+    barcw = font->max_bounds.width;
+    barch = font->ascent + font->descent;
+    baratlas = XCreatePixmap(dpy, root, 95 * barcw, 2 * barch, DefaultDepth(dpy, screen));
+    /* Copies from the atlas must not send NoExpose events */
+    gcv.font = font->fid;
+    gcv.graphics_exposures = False;
+    bargc = XCreateGC(dpy, root, GCFont | GCGraphicsExposures, &gcv);
+    for (int v = 0; v < 2; v++) {
+        XSetForeground(dpy, bargc, bg[v]);
+        XFillRectangle(dpy, baratlas, bargc, 0, v * barch, 95 * barcw, barch);
+        XSetForeground(dpy, bargc, fg[v]);
+        /* One glyph per cell so proportional fonts stay on the grid */
+        for (int i = 0; i < 95; i++) {
+            glyph = 32 + i;
+            XDrawString(dpy, baratlas, bargc, i * barcw, v * barch + font->ascent, &glyph, 1);
+        }
+    }
+    XFreeFont(dpy, font);  /* The server keeps it while the GC uses it */
+    barh = barch + 4;
+}
+
+/* Create or resize the bar of a monitor whose geometry changed */
+static void
+barplace(Monitor *m)
+{
+    XSetWindowAttributes wa;
+
+    if (!barh)
+        return;
+    if (m->barpix)
+        XFreePixmap(dpy, m->barpix);
+    m->barpix = XCreatePixmap(dpy, root, m->mw, barh, DefaultDepth(dpy, screen));
+    XSetForeground(dpy, bargc, BAR_BG);
+    XFillRectangle(dpy, m->barpix, bargc, 0, 0, m->mw, barh);
+    memset(m->seg, 0, sizeof(m->seg));
+    if (!m->barwin) {
+        wa.override_redirect = True;
+        wa.background_pixmap = m->barpix;
+        m->barwin = XCreateWindow(dpy, root, m->mx, m->my, m->mw, barh, 0,
+                                  CopyFromParent, InputOutput, CopyFromParent,
+                                  CWOverrideRedirect | CWBackPixmap, &wa);
+        XMapRaised(dpy, m->barwin);
+    } else {
+        XSetWindowBackgroundPixmap(dpy, m->barwin, m->barpix);
+        XMoveResizeWindow(dpy, m->barwin, m->mx, m->my, m->mw, barh);
+    }
+}
+
+static void
+barsegment(Monitor *m, int i, int x, int w, const char *text, int selected)
+{
+    BarSeg *s = &m->seg[i];
+    const unsigned char *p;
+    int cx = x, g;
+
+    if (s->valid && s->selected == selected && !strcmp(s->text, text))
+        return;
+    snprintf(s->text, sizeof(s->text), "%s", text);
+    s->selected = selected;
+    s->valid = 1;
+
+    XSetForeground(dpy, bargc, selected ? BAR_SEL_BG : BAR_BG);
+    XFillRectangle(dpy, m->barpix, bargc, x, 0, w, barh);
+    for (p = (const unsigned char *)text; *p && cx + barcw <= x + w; p++) {
+        if ((*p & 0xc0) == 0x80)
+            continue;           /* UTF-8 continuation, the lead byte shows as '?' */
+        g = *p >= 32 && *p < 127 ? *p - 32 : '?' - 32;
+        XCopyArea(dpy, baratlas, m->barpix, bargc, g * barcw, selected * barch,
+                  barcw, barch, cx, 2);
+        cx += barcw;
+    }
+    XClearArea(dpy, m->barwin, x, 0, w, barh, False);
+    barredraws++;
+}
+
+static void
+drawbar(Monitor *m)
+{
+    char buf[16];
+    int i, n, x = 0, w = BARWSCHARS * barcw;
+    Client *c = sel && sel->mon == m ? sel : NULL;
+
+    if (!m->barwin)
+        return;
+    for (i = 1; i <= 9; i++, x += w) {
+        n = count_windows_in_workspace(m, i);
+        snprintf(buf, sizeof(buf), n ? " %d:%d" : " %d", i, n);
+        barsegment(m, i - 1, x, w, buf, i == m->workspace);
+    }
+    if (c && c->titlestale)
+        updatetitle(c);
+    barsegment(m, BARSEGS - 1, x + barcw, m->mw - x - barcw, c ? c->title : "", 0);
+}
+
+/* Create the shared-memory state page read by panels and scrapers */
+static void
+setupstate(void)
+{
+    const char *display = DisplayString(dpy);
+    const char *num = strchr(display, ':');
+    int fd;
+
+    snprintf(statename, sizeof(statename), "/wm-state.%u.%s",
+             (unsigned int)getuid(), num ? num + 1 : "0");
+
+    /* Titles and focus are private, readers run as the same user */
+    fd = shm_open(statename, O_CREAT | O_RDWR, 0600);
+    if (fd < 0) {
+        wm_log("Failed to create state page %s: %s\n", statename, strerror(errno));
+        return;
+    }
+    /* A page left by an older build may be readable by everyone */
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_uid != getuid() || fchmod(fd, 0600) < 0) {
+        wm_log("State page %s is not ours or cannot be made private\n", statename);
+        close(fd);
+        return;
+    }
+    if (ftruncate(fd, sizeof(WMState)) < 0) {
+        wm_log("Failed to size state page: %s\n", strerror(errno));
+        close(fd);
+        return;
+    }
+    statepage = mmap(NULL, sizeof(WMState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (statepage == MAP_FAILED) {
+        wm_log("Failed to map state page: %s\n", strerror(errno));
+        statepage = NULL;
+        return;
+    }
+
+    memset(statepage, 0, sizeof(WMState));
+    statepage->version = WMSTATE_VERSION;
+    statepage->size = sizeof(WMState);
+    __atomic_store_n(&statepage->magic, WMSTATE_MAGIC, __ATOMIC_RELEASE);
+    wm_log("Publishing state page %s\n", statename);
+}
+
+/* Publish current workspace, window counts and focus to the state page */
+static void
+publishstate(void)
+{
+    Client *c;
+    Monitor *m;
+    uint32_t seq;
+
+    sessionchanged();
+    for (m = mons; barh && m; m = m->next)
+        drawbar(m);
+    if (!statepage)
+        return;
+
+    /* Seqlock write: odd sequence while the fields are inconsistent */
+    seq = statepage->seq;
+    __atomic_store_n(&statepage->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    statepage->current_workspace = selmon->workspace;
+    statepage->nclients = 0;
+    memset(statepage->wincount, 0, sizeof(statepage->wincount));
+    memset(statepage->mon, 0, sizeof(statepage->mon));
+    for (m = mons; m; m = m->next) {
+        WMStateMonitor *sm = &statepage->mon[m->num];
+        sm->x = m->mx;
+        sm->y = m->my;
+        sm->w = m->mw;
+        sm->h = m->mh;
+        sm->workspace = m->workspace;
+        statepage->nmonitors = m->num + 1;
+        if (m == selmon)
+            statepage->selmon = m->num;
+    }
+    memset(statepage->pixmap_bytes, 0, sizeof(statepage->pixmap_bytes));
+    memset(statepage->xwindows, 0, sizeof(statepage->xwindows));
+    for (c = clients; c; c = c->next) {
+        statepage->nclients++;
+        if (c->workspace > 0 && c->workspace < WMSTATE_WORKSPACES) {
+            statepage->wincount[c->workspace]++;
+            statepage->mon[c->mon->num].wincount[c->workspace]++;
+            statepage->pixmap_bytes[c->workspace] += c->xresbytes;
+            statepage->xwindows[c->workspace] += c->xreswindows;
+        }
+    }
+#ifdef XRES
+    statepage->xres_samples = xressamples;
+    statepage->nxres = nxresusage < WMSTATE_XRES_TOP ? nxresusage : WMSTATE_XRES_TOP;
+    for (uint32_t i = 0; i < statepage->nxres; i++) {
+        statepage->xres[i].window = xresusage[i].win;
+        statepage->xres[i].pixmap_bytes = xresusage[i].bytes;
+        statepage->xres[i].pid = xresusage[i].pid;
+        statepage->xres[i].windows = xresusage[i].windows;
+    }
+#endif
+    statepage->focused = sel ? sel->win : 0;
+    statepage->focused_fullscreen = sel ? sel->isfullscreen : 0;
+    statepage->updates++;
+
+    __atomic_store_n(&statepage->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Built-in master/stack layout: master on the left, the rest stacked */
+static void
+tilearrange(const WMLayoutParams *p, WMRect *out)
+{
+    const WMRect *a = &p->area;
+    int g = p->gap, b = p->border;
+
+    if (p->n == 1) {
+        out[0] = *a;
+        return;
+    }
+    out[0].x = a->x + g;
+    out[0].y = a->y + g;
+    out[0].w = (a->w * p->mfact) - (g * 1.5) - (b * 2);
+    out[0].h = a->h - (g * 2) - (b * 2);
+
+    int height = (a->h / (p->n - 1)) - (g * 2) - (b * 2);
+    for (int i = 1; i < p->n; i++) {
+        out[i].x = a->x + (a->w * p->mfact) + (g * 0.5);
+        out[i].y = a->y + ((i - 1) * (height + g)) + g;
+        out[i].w = (a->w * (1 - p->mfact)) - (g * 1.5) - (b * 2);
+        out[i].h = height;
+    }
+}
+
+/* Built-in monocle layout: every tiled window gets the whole area, and
+ * applylayout() only keeps the focused one mapped */
+static void
+monoclearrange(const WMLayoutParams *p, WMRect *out)
+{
+    const WMRect *a = &p->area;
+    int g = p->gap, b = p->border;
+
+    for (int i = 0; i < p->n; i++) {
+        out[i].x = a->x + g;
+        out[i].y = a->y + g;
+        out[i].w = a->w - (g * 2) - (b * 2);
+        out[i].h = a->h - (g * 2) - (b * 2);
+    }
+}
+
+static const WMLayout tileabi = { WMLAYOUT_ABI, "tile", tilearrange };
+static const WMLayout monocleabi = { WMLAYOUT_ABI, "monocle", monoclearrange };
+static Layout monoclelayout = { &monocleabi, NULL, "monocle", 1, NULL, 1 };
+static Layout tilelayout = { &tileabi, NULL, "tile", 1, &monoclelayout, 0 };
+static Layout *layouts = &tilelayout;  /* Loaded layouts, built-ins last */
+
+/* Open a layout plugin into lt, returns 0 on failure */
+static int
+openlayout(Layout *lt)
+{
+    const WMLayout *l;
+
+    if (!(lt->handle = dlopen(lt->path, RTLD_NOW | RTLD_LOCAL))) {
+        wm_log("Cannot load layout: %s\n", dlerror());
+        return 0;
+    }
+    l = dlsym(lt->handle, "wm_layout");
+    if (!l || l->abi != WMLAYOUT_ABI || !l->arrange) {
+        wm_log("%s is not a version %d layout\n", lt->path, WMLAYOUT_ABI);
+        dlclose(lt->handle);
+        lt->handle = NULL;
+        return 0;
+    }
+    lt->l = l;
+    return 1;
+}
+
+/* Find a layout by name ("tile") or plugin path, loading it if needed */
+static Layout *
+getlayout(const char *name)
+{
+    char path[PATH_MAX];
+    Layout *lt;
+
+    if (name[0] == '~')
+        snprintf(path, sizeof(path), "%s%s", getenv("HOME"), name + 1);
+    else
+        snprintf(path, sizeof(path), "%s", name);
+
+    for (lt = layouts; lt; lt = lt->next)
+        if (!strcmp(lt->path, path) || !strcmp(lt->l->name, path)) {
+            lt->refs++;
+            return lt;
+        }
+
+    if (!(lt = calloc(1, sizeof(Layout)))) {
+        wm_log("Failed to allocate memory for layout %s\n", path);
+        return NULL;
+    }
+    snprintf(lt->path, sizeof(lt->path), "%s", path);
+    if (!openlayout(lt)) {
+        free(lt);
+        return NULL;
+    }
+    lt->refs = 1;
+    lt->next = layouts;
+    layouts = lt;
+    return lt;
+}
+
+/* Drop a workspace's reference, unloading plugins nobody uses */
+static void
+releaselayout(Layout *lt)
+{
+    Layout **lp;
+
+    if (!lt || --lt->refs > 0 || !lt->handle)
+        return;
+    for (lp = &layouts; *lp != lt; lp = &(*lp)->next);
+    *lp = lt->next;
+    dlclose(lt->handle);
+    free(lt);
+}
+
+static Monitor *
+createmon(void)
+{
+    Monitor *m = calloc(1, sizeof(Monitor));
+    if (!m) {
+        wm_log("Fatal: failed to allocate memory for monitor\n");
+        exit(1);
+    }
+    m->workspace = 1;
+    m->mfact = MASTER_SIZE;
+    for (int i = 1; i <= 9; i++) {
+        m->lt[i] = &tilelayout;
+        tilelayout.refs++;
+    }
+    return m;
+}
+
+/* Sync the monitor list with the active outputs.
+ * Returns 1 if any monitor was added, removed or changed geometry. */
+static int
+updategeom(void)
+{
+    XRectangle rects[MAXMONITORS];
+    Monitor *m, **mp;
+    Client *c;
+    int n = 0, dirty = 0, i;
+
+#ifdef XRANDR
+    if (xrandr) {
+        /* GetScreenResourcesCurrent does not probe outputs, so it stays fast */
+        XRRScreenResources *sr = XRRGetScreenResourcesCurrent(dpy, root);
+        for (i = 0; sr && i < sr->ncrtc && n < MAXMONITORS; i++) {
+            XRRCrtcInfo *ci = XRRGetCrtcInfo(dpy, sr, sr->crtcs[i]);
+            int j;
+            if (!ci)
+                continue;
+            if (ci->mode != None && ci->noutput > 0) {
+                /* Cloned outputs share a crtc geometry, manage them once */
+                for (j = 0; j < n; j++)
+                    if (rects[j].x == ci->x && rects[j].y == ci->y &&
+                        rects[j].width == ci->width && rects[j].height == ci->height)
+                        break;
+                if (j == n) {
+                    rects[n].x = ci->x;
+                    rects[n].y = ci->y;
+                    rects[n].width = ci->width;
+                    rects[n].height = ci->height;
+                    n++;
+                }
+            }
+            XRRFreeCrtcInfo(ci);
+        }
+        if (sr)
+            XRRFreeScreenResources(sr);
+    }
+#endif
+    if (n == 0) {
+        rects[0].x = 0;
+        rects[0].y = 0;
+        rects[0].width = attr.width;
+        rects[0].height = attr.height;
+        n = 1;
+    }
+
+    /* Create or update one monitor per output */
+    for (i = 0, mp = &mons; i < n; i++, mp = &(*mp)->next) {
+        if (!*mp)
+            *mp = createmon();
+        m = *mp;
+        m->num = i;
+        if (m->mx != rects[i].x || m->my != rects[i].y ||
+            m->mw != rects[i].width || m->mh != rects[i].height) {
+            m->mx = m->wx = rects[i].x;
+            m->my = m->wy = rects[i].y;
+            m->mw = m->ww = rects[i].width;
+            m->mh = m->wh = rects[i].height;
+            m->wy += barh;
+            m->wh -= barh;
+            barplace(m);
+            m->dirty = 1;
+            dirty = 1;
+        }
+    }
+
+    /* Outputs that went away hand their clients to the first monitor */
+    while (*mp) {
+        m = *mp;
+        *mp = m->next;
+        for (c = clients; c; c = c->next) {
+            if (c->mon != m)
+                continue;
+            c->mon = mons;
+            setvisible(c, ISVISIBLE(c));
+        }
+        if (selmon == m)
+            selmon = mons;
+        for (i = 1; i <= 9; i++)
+            releaselayout(m->lt[i]);
+        if (m->barwin) {
+            XDestroyWindow(dpy, m->barwin);
+            XFreePixmap(dpy, m->barpix);
+        }
+        free(m);
+        mons->dirty = 1;
+        dirty = 1;
+    }
+
+    if (!selmon)
+        selmon = mons;
+    return dirty;
+}
+
+/* Re-read output geometry and relayout only the monitors that changed */
+static void
+updatemons(void)
+{
+    struct timespec t0, t1;
+    Monitor *m;
+    int n = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (!updategeom())
+        return;
+
+    for (m = mons; m; m = m->next) {
+        if (m->dirty) {
+            applylayout(m);
+            m->dirty = 0;
+            n++;
+        }
+    }
+    spatialreset();
+    publishstate();
+    updateweights();
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    wm_log("Screen %dx%d changed, relayout of %d monitor(s) took %.2fms\n",
+           attr.width, attr.height, n,
+           (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+}
+
+/* Root window resized, e.g. by xrandr without the extension events */
+void
+configurenotify(XEvent *e)
+{
+    XConfigureEvent *ev = &e->xconfigure;
+
+    if (ev->window != root)
+        return;
+#ifdef XRANDR
+    if (xrandr)
+        XRRUpdateConfiguration(e);
+#endif
+    attr.width = ev->width;
+    attr.height = ev->height;
+    updatemons();
+}
+
+#ifdef XRANDR
+/* Output hotplug, rotation or mode change */
+static void
+rrnotify(XEvent *e)
+{
+    XRRUpdateConfiguration(e);
+    attr.width = DisplayWidth(dpy, screen);
+    attr.height = DisplayHeight(dpy, screen);
+    updatemons();
+}
+#endif
+
+/* Rules compiled into hash chains keyed on class (or instance), the
+ * extra bucket chains rules that match any class */
+static int rulehead[RULEBUCKETS + 1];
+static int rulenext[sizeof(rules)/sizeof(rules[0])];
+
+static unsigned int
+rulehash(const char *str)
+{
+    unsigned int h = 2166136261u;  /* FNV-1a */
+    while (*str)
+        h = (h ^ (unsigned char)*str++) * 16777619u;
+    return h % RULEBUCKETS;
+}
+
+static void
+compilerules(void)
+{
+    int i, b;
+
+    for (b = 0; b <= RULEBUCKETS; b++)
+        rulehead[b] = -1;
+
+    /* Insert back to front so every chain stays in table order */
+    for (i = sizeof(rules)/sizeof(rules[0]) - 1; i >= 0; i--) {
+        const char *key = rules[i].class ? rules[i].class : rules[i].instance;
+        b = key ? (int)rulehash(key) : RULEBUCKETS;
+        rulenext[i] = rulehead[b];
+        rulehead[b] = i;
+    }
+}
+
+static int
+rulematches(const Rule *r, const Client *c)
+{
+    return (!r->class || !strcmp(r->class, c->class)) &&
+           (!r->instance || !strcmp(r->instance, c->instance)) &&
+           (!r->role || !strcmp(r->role, c->role)) &&
+           (!r->title || strstr(c->title, r->title));
+}
+
+/* Apply all rules matching the client's properties, in table order */
+static void
+applyrules(Client *c)
+{
+    unsigned char matched[sizeof(rules)/sizeof(rules[0])] = {0};
+    int probe[3], i, j;
+
+    probe[0] = rulehash(c->class);
+    probe[1] = rulehash(c->instance);
+    probe[2] = RULEBUCKETS;
+    for (j = 0; j < 3; j++)
+        for (i = rulehead[probe[j]]; i >= 0; i = rulenext[i])
+            if (rulematches(&rules[i], c))
+                matched[i] = 1;
+
+    for (i = 0; i < (int)(sizeof(rules)/sizeof(rules[0])); i++) {
+        const Rule *r = &rules[i];
+        if (!matched[i])
+            continue;
+        if (r->workspace >= 1 && r->workspace <= 9)
+            c->workspace = r->workspace;
+        if (r->isfloating)
+            c->isfloating = 1;
+        if (r->isfullscreen)
+            c->isfullscreen = 1;
+        if (r->w > 0 && r->h > 0) {
+            c->x = c->mon->wx + r->x;
+            c->y = c->mon->wy + r->y;
+            c->w = r->w;
+            c->h = r->h;
+            c->placed = 1;
+        }
+        if (r->freeze)
+            c->freeze = 1;
+        wm_log("Rule %d matched %s/%s \"%s\"\n", i, c->class, c->instance, c->title);
+    }
+}
+
+static Client *
+wintoclient(Window w)
 {
     Client *c;
     for (c = clients; c; c = c->next)
-        if (c->isfullscreen && c->workspace == current_workspace)
+        if (c->win == w)
             return c;
     return NULL;
 }
 
+/* Remember a request sent through xcb: Xlib only numbers it in NextRequest()
+ * once it sends a request of its own */
+static void
+xcsent(unsigned int sequence)
+{
+    xcnext = sequence + 1;
+}
+
+/* Number of the next request on the connection, whichever side sends it */
+static unsigned int
+nextrequest(void)
+{
+    unsigned int n = NextRequest(dpy);
+    return (int)(xcnext - n) > 0 ? xcnext : n;
+}
+
+/* Queue the property reads for a window without waiting for replies */
+static void
+propsend(Window w, PropRequest *r)
+{
+    static const uint32_t len[PropLast] = {
+        [PropClass] = 32, [PropRole] = 16, [PropNetName] = 64, [PropName] = 64,
+        [PropPid] = 1, [PropTransient] = 1, [PropType] = 1,
+        [PropNormalHints] = 18,  /* Size of the wire XSizeHints */
+    };
+    xcb_atom_t a[PropLast] = {
+        [PropClass] = XA_WM_CLASS, [PropRole] = atom[WMWindowRole],
+        [PropNetName] = atom[NetWMName], [PropName] = XA_WM_NAME,
+        [PropPid] = atom[NetWMPid], [PropTransient] = XA_WM_TRANSIENT_FOR,
+        [PropType] = atom[NetWMWindowType], [PropNormalHints] = XA_WM_NORMAL_HINTS,
+    };
+
+    for (int i = 0; i < PropLast; i++)
+        r->prop[i] = xcb_get_property(xc, 0, w, a[i], XCB_GET_PROPERTY_TYPE_ANY, 0, len[i]);
+    xcsent(r->prop[PropLast - 1].sequence);
+}
+
+static void
+copyprop(char *buf, size_t size, const char *value, int len)
+{
+    if (len < 0)
+        len = 0;
+    if ((size_t)len >= size)
+        len = size - 1;
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+}
+
+static void
+propdiscard(PropRequest *r)
+{
+    for (int i = 0; i < PropLast; i++)
+        xcb_discard_reply(xc, r->prop[i].sequence);
+}
+
+/* Cache the size constraints of WM_NORMAL_HINTS */
+static void
+updatesizehints(Client *c, const XSizeHints *sh)
+{
+    long f = sh->flags;
+
+    c->basew = c->baseh = c->incw = c->inch = 0;
+    c->minw = c->minh = c->maxw = c->maxh = 0;
+    c->mina = c->maxa = 0;
+    if (f & PBaseSize) {
+        c->basew = sh->base_width;
+        c->baseh = sh->base_height;
+    } else if (f & PMinSize) {
+        c->basew = sh->min_width;
+        c->baseh = sh->min_height;
+    }
+    if (f & PResizeInc) {
+        c->incw = sh->width_inc;
+        c->inch = sh->height_inc;
+    }
+    if (f & PMaxSize) {
+        c->maxw = sh->max_width;
+        c->maxh = sh->max_height;
+    }
+    if (f & PMinSize) {
+        c->minw = sh->min_width;
+        c->minh = sh->min_height;
+    } else if (f & PBaseSize) {
+        c->minw = sh->base_width;
+        c->minh = sh->base_height;
+    }
+    if (f & PAspect && sh->min_aspect.x > 0 && sh->max_aspect.y > 0) {
+        c->mina = (float)sh->min_aspect.y / sh->min_aspect.x;
+        c->maxa = (float)sh->max_aspect.x / sh->max_aspect.y;
+    }
+}
+
+/* Collect the replies queued by propsend() into the client */
+static void
+propreceive(Client *c, PropRequest *r)
+{
+    xcb_get_property_reply_t *rep;
+
+    c->class[0] = c->instance[0] = c->role[0] = c->title[0] = '\0';
+    c->pid = 0;
+    c->transientfor = None;
+    c->wtype = None;
+    for (int i = 0; i < PropLast; i++) {
+        if (!(rep = xcb_get_property_reply(xc, r->prop[i], NULL)))
+            continue;
+        const char *v = xcb_get_property_value(rep);
+        int len = xcb_get_property_value_length(rep);
+
+        switch (i) {
+        case PropClass:
+            /* instance\0class\0 */
+            copyprop(c->instance, sizeof(c->instance), v, strnlen(v, len));
+            if ((int)strlen(c->instance) + 1 < len)
+                copyprop(c->class, sizeof(c->class), v + strlen(c->instance) + 1,
+                         strnlen(v + strlen(c->instance) + 1, len - strlen(c->instance) - 1));
+            break;
+        case PropRole:
+            copyprop(c->role, sizeof(c->role), v, len);
+            break;
+        case PropNetName:
+            copyprop(c->title, sizeof(c->title), v, len);
+            break;
+        case PropName:
+            if (!c->title[0])
+                copyprop(c->title, sizeof(c->title), v, len);
+            break;
+        case PropPid:
+            if (rep->format == 32 && len >= 4)
+                c->pid = *(const uint32_t *)v;
+            break;
+        case PropTransient:
+            if (rep->format == 32 && len >= 4)
+                c->transientfor = *(const uint32_t *)v;
+            break;
+        case PropType:
+            if (rep->format == 32 && len >= 4)
+                c->wtype = *(const uint32_t *)v;
+            break;
+        case PropNormalHints:
+            /* Wire layout: flags, x, y, w, h, min, max, inc, aspects, base, gravity */
+            if (rep->format == 32 && len >= 15 * 4) {
+                const uint32_t *d = (const uint32_t *)v;
+                XSizeHints sh = { 0 };
+                sh.flags = d[0];
+                sh.min_width = d[5];
+                sh.min_height = d[6];
+                sh.max_width = d[7];
+                sh.max_height = d[8];
+                sh.width_inc = d[9];
+                sh.height_inc = d[10];
+                sh.min_aspect.x = d[11];
+                sh.min_aspect.y = d[12];
+                sh.max_aspect.x = d[13];
+                sh.max_aspect.y = d[14];
+                if (len >= 17 * 4) {
+                    sh.base_width = d[15];
+                    sh.base_height = d[16];
+                } else {
+                    sh.flags &= ~PBaseSize;
+                }
+                updatesizehints(c, &sh);
+            }
+            break;
+        }
+        free(rep);
+    }
+}
+
+/* Re-read the title of a window, for the bar */
+static void
+updatetitle(Client *c)
+{
+    xcb_get_property_cookie_t ck[2];
+    xcb_get_property_reply_t *rep;
+
+    ck[0] = xcb_get_property(xc, 0, c->win, atom[NetWMName], XCB_GET_PROPERTY_TYPE_ANY, 0, 64);
+    ck[1] = xcb_get_property(xc, 0, c->win, XA_WM_NAME, XCB_GET_PROPERTY_TYPE_ANY, 0, 64);
+    xcsent(ck[1].sequence);
+    c->title[0] = '\0';
+    for (int i = 0; i < 2; i++) {
+        if (!(rep = xcb_get_property_reply(xc, ck[i], NULL)))
+            continue;
+        if (!c->title[0])
+            copyprop(c->title, sizeof(c->title), xcb_get_property_value(rep),
+                     xcb_get_property_value_length(rep));
+        free(rep);
+    }
+    c->titlestale = 0;
+}
+
+/* Read the properties rules match on with a single round trip */
+static void
+fetchprops(Client *c)
+{
+    PropRequest r;
+
+    propsend(c->win, &r);
+    propreceive(c, &r);
+}
+
 /* Add these validation functions near the top */
 static int
 validate_window_size(int w, int h) {
@@ -177,6 +1335,14 @@ validate_spawn_args(const char **arg) {
         }
     }
 
+    /* Command lines restored from the session may name the binary directly */
+    if (strchr(arg[0], '/')) {
+        if (access(arg[0], X_OK) == 0)
+            return 1;
+        wm_log("Command not executable: %s\n", arg[0]);
+        return 0;
+    }
+
     /* Validate executable path */
     char *path = getenv("PATH");
     if (!path) {
@@ -213,25 +1379,425 @@ validate_spawn_args(const char **arg) {
     return 1;
 }
 
-/* Add this helper function before maprequest */
+/* Transient graph: dialogs float centered over their parent and stay above it */
 static int
-is_child_of_fullscreen(Window win) {
-    Window root, parent, *children;
-    unsigned int nchildren;
-    Client *fs = find_fullscreen();
+isdialogtype(Atom type)
+{
+    return type != None && (type == atom[NetWMWindowTypeDialog] ||
+                            type == atom[NetWMWindowTypeUtility] ||
+                            type == atom[NetWMWindowTypeSplash] ||
+                            type == atom[NetWMWindowTypeToolbar]);
+}
 
-    if (!fs) return 0;
+static Client *wintoclient(Window w);
 
-    if (!XQueryTree(dpy, win, &root, &parent, &children, &nchildren))
-        return 0;
+/* Spatial index
+ * Client rectangles (borders included) are bucketed in a uniform grid of
+ * SPATIAL_CELL pixel cells over the root window, one grid per workspace
+ * number. Hit-testing and floating placement look at the few cells they
+ * touch instead of asking the server or walking every client. Entries are
+ * refreshed by spatialsync() whenever arrange, resize or a drag may have
+ * moved a client. */
+#define SPATIAL_CELL 256
 
-    if (children)
-        XFree(children);
+typedef struct {
+    Client **c;
+    int n, size;
+} Cell;
 
-    return (parent == fs->win);
-}
+static Cell *spatial[10];          /* Grid per workspace, NULL until used */
+static int spatialcols, spatialrows;
+static unsigned long raiseseq = 0;
 
-void
+static void
+cellrange(int x, int y, int w, int h, int *c0, int *r0, int *c1, int *r1)
+{
+    *c0 = x < 0 ? 0 : x / SPATIAL_CELL;
+    *r0 = y < 0 ? 0 : y / SPATIAL_CELL;
+    *c1 = (x + w - 1) / SPATIAL_CELL;
+    *r1 = (y + h - 1) / SPATIAL_CELL;
+    if (*c1 >= spatialcols)
+        *c1 = spatialcols - 1;
+    if (*r1 >= spatialrows)
+        *r1 = spatialrows - 1;
+}
+
+static void
+spatialremove(Client *c)
+{
+    int c0, r0, c1, r1, col, row, i;
+
+    if (!c->indexed)
+        return;
+    c->indexed = 0;
+    if (!spatial[c->iws])
+        return;
+    cellrange(c->ix, c->iy, c->iw, c->ih, &c0, &r0, &c1, &r1);
+    for (row = r0; row <= r1; row++)
+        for (col = c0; col <= c1; col++) {
+            Cell *cell = &spatial[c->iws][row * spatialcols + col];
+            for (i = 0; i < cell->n; i++)
+                if (cell->c[i] == c) {
+                    cell->c[i] = cell->c[--cell->n];
+                    break;
+                }
+        }
+}
+
+/* Bring the index entry of a client up to date, cheap when nothing moved */
+static void
+spatialsync(Client *c)
+{
+    int c0, r0, c1, r1, col, row;
+    int w = c->w + 2 * BORDER_WIDTH, h = c->h + 2 * BORDER_WIDTH;
+
+    if (c->indexed && c->ix == c->x && c->iy == c->y && c->iw == w &&
+        c->ih == h && c->iws == c->workspace)
+        return;
+    spatialremove(c);
+    if (c->workspace < 0 || c->workspace > 9 || w <= 0 || h <= 0 ||
+        c->x >= attr.width || c->y >= attr.height || c->x + w <= 0 || c->y + h <= 0)
+        return;
+
+    if (!spatial[c->workspace]) {
+        spatialcols = (attr.width + SPATIAL_CELL - 1) / SPATIAL_CELL;
+        spatialrows = (attr.height + SPATIAL_CELL - 1) / SPATIAL_CELL;
+        if (!(spatial[c->workspace] = calloc(spatialcols * spatialrows, sizeof(Cell)))) {
+            wm_log("Failed to allocate memory for the spatial index\n");
+            return;
+        }
+    }
+    c->ix = c->x;
+    c->iy = c->y;
+    c->iw = w;
+    c->ih = h;
+    c->iws = c->workspace;
+    c->indexed = 1;
+    cellrange(c->ix, c->iy, c->iw, c->ih, &c0, &r0, &c1, &r1);
+    for (row = r0; row <= r1; row++)
+        for (col = c0; col <= c1; col++) {
+            Cell *cell = &spatial[c->iws][row * spatialcols + col];
+            if (cell->n == cell->size) {
+                int size = cell->size ? cell->size * 2 : 4;
+                Client **nc = realloc(cell->c, size * sizeof(Client *));
+                if (!nc) {
+                    wm_log("Failed to grow the spatial index\n");
+                    continue;
+                }
+                cell->c = nc;
+                cell->size = size;
+            }
+            cell->c[cell->n++] = c;
+        }
+}
+
+/* Drop every grid, e.g. when the root window changes size */
+static void
+spatialreset(void)
+{
+    for (int ws = 0; ws <= 9; ws++) {
+        if (!spatial[ws])
+            continue;
+        for (int i = 0; i < spatialcols * spatialrows; i++)
+            free(spatial[ws][i].c);
+        free(spatial[ws]);
+        spatial[ws] = NULL;
+    }
+    for (Client *c = clients; c; c = c->next) {
+        c->indexed = 0;
+        spatialsync(c);
+    }
+}
+
+/* Topmost visible client of a monitor containing a point, ignoring skip.
+ * Fullscreen covers the monitor, floating windows lie above tiled ones. */
+static Client *
+clientat(Monitor *m, int x, int y, Client *skip)
+{
+    Client *c, *best = NULL, *fs = find_fullscreen(m);
+    Cell *cell;
+
+    if (fs && fs != skip)
+        return fs;
+    if (!spatial[m->workspace] || x < 0 || y < 0 ||
+        x / SPATIAL_CELL >= spatialcols || y / SPATIAL_CELL >= spatialrows)
+        return NULL;
+    cell = &spatial[m->workspace][(y / SPATIAL_CELL) * spatialcols + x / SPATIAL_CELL];
+    for (int i = 0; i < cell->n; i++) {
+        c = cell->c[i];
+        if (c == skip || c->mon != m || !ISVISIBLE(c) || c->hidden ||
+            x < c->ix || y < c->iy || x >= c->ix + c->iw || y >= c->iy + c->ih)
+            continue;
+        if (!best || c->isfloating > best->isfloating ||
+            (c->isfloating == best->isfloating && c->raised > best->raised))
+            best = c;
+    }
+    return best;
+}
+
+/* Tiled client of a monitor closest to a point, for drops into the gaps */
+static Client *
+tilednear(Monitor *m, int x, int y, Client *skip)
+{
+    Client *c, *best = NULL;
+    long bestd = -1;
+    int col = x / SPATIAL_CELL, row = y / SPATIAL_CELL;
+
+    if (!spatial[m->workspace])
+        return NULL;
+    /* Rings of cells around the point until no closer client can exist */
+    for (int r = 0; r < spatialcols + spatialrows; r++) {
+        if (bestd >= 0 && (long)(r - 1) * SPATIAL_CELL * (r - 1) * SPATIAL_CELL > bestd)
+            break;
+        for (int rr = row - r; rr <= row + r; rr++)
+            for (int cc = col - r; cc <= col + r; cc++) {
+                if (rr < 0 || cc < 0 || rr >= spatialrows || cc >= spatialcols ||
+                    (abs(rr - row) != r && abs(cc - col) != r))
+                    continue;
+                Cell *cell = &spatial[m->workspace][rr * spatialcols + cc];
+                for (int i = 0; i < cell->n; i++) {
+                    c = cell->c[i];
+                    if (c == skip || c->mon != m || !ISVISIBLE(c) || c->isfloating ||
+                        c->hidden)
+                        continue;
+                    long dx = x < c->ix ? c->ix - x : x >= c->ix + c->iw ? x - (c->ix + c->iw - 1) : 0;
+                    long dy = y < c->iy ? c->iy - y : y >= c->iy + c->ih ? y - (c->iy + c->ih - 1) : 0;
+                    if (bestd < 0 || dx * dx + dy * dy < bestd) {
+                        bestd = dx * dx + dy * dy;
+                        best = c;
+                    }
+                }
+            }
+    }
+    return best;
+}
+
+/* Area a rectangle shares with the floating windows of a workspace */
+static long
+floatoverlap(Monitor *m, int ws, int x, int y, int w, int h)
+{
+    int c0, r0, c1, r1, col, row;
+    long area = 0;
+    Client *c;
+
+    if (!spatial[ws])
+        return 0;
+    cellrange(x, y, w, h, &c0, &r0, &c1, &r1);
+    for (row = r0; row <= r1; row++)
+        for (col = c0; col <= c1; col++) {
+            Cell *cell = &spatial[ws][row * spatialcols + col];
+            for (int i = 0; i < cell->n; i++) {
+                c = cell->c[i];
+                if (!c->isfloating || c->mon != m)
+                    continue;
+                /* Count a window once, in the first cell both share */
+                int fc = (c->ix > x ? c->ix : x) / SPATIAL_CELL;
+                int fr = (c->iy > y ? c->iy : y) / SPATIAL_CELL;
+                if (fc != col || fr != row)
+                    continue;
+                long ow = (x + w < c->ix + c->iw ? x + w : c->ix + c->iw) - (x > c->ix ? x : c->ix);
+                long oh = (y + h < c->iy + c->ih ? y + h : c->iy + c->ih) - (y > c->iy ? y : c->iy);
+                if (ow > 0 && oh > 0)
+                    area += ow * oh;
+            }
+        }
+    return area;
+}
+
+/* Smart placement: the spot with the least floating overlap, trying the
+ * work area corner and the right and bottom edges of floating windows */
+static void
+placefloating(Client *c)
+{
+    Monitor *m = c->mon;
+    int w = c->w + 2 * BORDER_WIDTH, h = c->h + 2 * BORDER_WIDTH;
+    int xs[64], ys[64], nx = 0, ny = 0, bx = c->x, by = c->y;
+    long best = -1;
+    Client *f;
+
+    if (w > m->ww || h > m->wh)
+        return;
+    xs[nx++] = m->wx + GAP_WIDTH;
+    ys[ny++] = m->wy + GAP_WIDTH;
+    for (f = clients; f; f = f->next) {
+        if (f == c || !f->isfloating || f->mon != m || f->workspace != c->workspace)
+            continue;
+        if (nx < 64 && f->x + f->w + 2 * BORDER_WIDTH + GAP_WIDTH + w <= m->wx + m->ww)
+            xs[nx++] = f->x + f->w + 2 * BORDER_WIDTH + GAP_WIDTH;
+        if (ny < 64 && f->y + f->h + 2 * BORDER_WIDTH + GAP_WIDTH + h <= m->wy + m->wh)
+            ys[ny++] = f->y + f->h + 2 * BORDER_WIDTH + GAP_WIDTH;
+    }
+    for (int j = 0; j < ny && best != 0; j++)
+        for (int i = 0; i < nx && best != 0; i++) {
+            long o = floatoverlap(m, c->workspace, xs[i], ys[j], w, h);
+            if (best < 0 || o < best) {
+                best = o;
+                bx = xs[i];
+                by = ys[j];
+            }
+        }
+    c->x = bx;
+    c->y = by;
+}
+
+/* Link a transient to its parent, on the parent's workspace */
+static void
+attachtransient(Client *c, Client *p)
+{
+    c->parent = p;
+    c->tnext = p->transients;
+    p->transients = c;
+    c->mon = p->mon;
+    c->workspace = p->workspace;
+}
+
+/* Attach a new client to the client it is transient for and float it */
+static void
+applytransient(Client *c)
+{
+    Client *p = c->transientfor != None ? wintoclient(c->transientfor) : NULL;
+    int px, py, pw, ph;
+
+    if (!p && !isdialogtype(c->wtype))
+        return;
+
+    c->isfloating = 1;
+    if (p)
+        attachtransient(c, p);
+
+    /* Center over the parent, or the monitor for parentless dialogs */
+    c->placed = 1;
+    if (p && !p->isfullscreen) {
+        px = p->x; py = p->y; pw = p->w; ph = p->h;
+    } else {
+        px = c->mon->wx; py = c->mon->wy; pw = c->mon->ww; ph = c->mon->wh;
+    }
+    c->x = px + (pw - c->w) / 2;
+    c->y = py + (ph - c->h) / 2;
+}
+
+/* Forget a client in the transient graph before it is freed */
+static void
+detachtransient(Client *c)
+{
+    Client **tp, *t;
+
+    if (c->parent) {
+        for (tp = &c->parent->transients; *tp && *tp != c; tp = &(*tp)->tnext);
+        if (*tp)
+            *tp = c->tnext;
+    }
+    for (t = c->transients; t; t = t->tnext)
+        t->parent = NULL;
+}
+
+/* Keep the transients of a client stacked directly above it */
+static void
+raisetransients(Client *c)
+{
+    for (Client *t = c->transients; t; t = t->tnext) {
+        if (!ISVISIBLE(t))
+            continue;
+        XRaiseWindow(dpy, t->win);
+        raisetransients(t);
+    }
+}
+
+/* Center the scratchpad over the work area of a monitor */
+static void
+placescratch(Client *c, Monitor *m)
+{
+    c->mon = m;
+    c->isfloating = 1;
+    c->placed = 1;
+    c->w = m->ww * SCRATCHPAD_WIDTH;
+    c->h = m->wh * SCRATCHPAD_HEIGHT;
+    c->x = m->wx + (m->ww - c->w) / 2;
+    c->y = m->wy + (m->wh - c->h) / 2;
+}
+
+/* Claim the first window with the scratchpad class as the scratchpad */
+static int
+claimscratch(Client *c)
+{
+    if (scratch || (strcmp(c->instance, SCRATCHPAD_CLASS) &&
+                    strcmp(c->class, SCRATCHPAD_CLASS)))
+        return 0;
+    scratch = c;
+    scratchlaunched = 0;
+    placescratch(c, selmon);
+    return 1;
+}
+
+static Client *
+newclient(Window w, int x, int y, int width, int height)
+{
+    Client *c = calloc(1, sizeof(Client));
+    if (!c) {
+        wm_log("Fatal: failed to allocate memory for new client\n");
+        return NULL;
+    }
+    c->win = w;
+    c->x = x;
+    c->y = y;
+    c->w = width;
+    c->h = height;
+    c->mon = selmon;
+    c->workspace = selmon->workspace;
+    return c;
+}
+
+/* Start managing a placed client, frees it if the workspace is full */
+static Client *
+manage(Client *c)
+{
+    Window w = c->win;
+
+    /* Check if we've reached the maximum for the target workspace */
+    if (count_windows_in_workspace(c->mon, c->workspace) >= MAX_WINDOWS) {
+        wm_log("Maximum number of windows (%d) reached in workspace %d\n",
+                MAX_WINDOWS, c->workspace);
+        if (scratch == c) {
+            scratch = NULL;
+            scratchshow = 0;
+        }
+        if (c->held)
+            sessionrelease(c);
+        detachtransient(c);
+        free(c);
+        return NULL;
+    }
+
+    /* Add the window to our list */
+    c->next = clients;
+    clients = c;
+    nclients++;
+
+    /* Set up window isolation */
+    XSetWindowAttributes swa;  // Changed variable name to swa
+    swa.event_mask = EnterWindowMask | PropertyChangeMask;  // Keys come from the root grabs
+    swa.override_redirect = True;  // Prevent direct window communication
+    swa.border_pixel = INACTIVE_BORDER;
+    XChangeWindowAttributes(dpy, w,
+                          CWEventMask | CWOverrideRedirect | CWBorderPixel,
+                          &swa);
+
+    /* Set initial border width */
+    XSetWindowBorderWidth(dpy, w, BORDER_WIDTH);
+
+    /* Add mouse button grabs; motion is only wanted once a drag starts */
+    XGrabButton(dpy, Button1, MODKEY, w, True,
+                ButtonPressMask | ButtonReleaseMask,
+                GrabModeAsync, GrabModeAsync, None, None);
+#ifdef XDAMAGE
+    if (damagemon)
+        c->damage = XDamageCreate(dpy, w, XDamageReportBoundingBox);
+#endif
+
+    return c;
+}
+
+void
 maprequest(XEvent *e)
 {
     if (!e) return;
@@ -257,66 +1823,74 @@ maprequest(XEvent *e)
         return;
     }
 
-    /* Check if we've reached the maximum for current workspace */
-    if (count_windows_in_workspace(current_workspace) >= MAX_WINDOWS) {
-        wm_log("Maximum number of windows (%d) reached in workspace %d\n",
-                MAX_WINDOWS, current_workspace);
+    if (wintoclient(ev->window))
+        return;
+    if (!(c = newclient(ev->window, wa.x, wa.y, wa.width, wa.height)))
         return;
+    /* The rules decide where the window goes before it is mapped */
+    fetchprops(c);
+    applyrules(c);
+    applytransient(c);
+    if (c->isfloating && !c->placed)
+        placefloating(c);
+    if (claimscratch(c)) {
+        /* Prelaunched scratchpads wait hidden for the first toggle */
+        c->workspace = scratchshow ? selmon->workspace : 0;
+        scratchshow = 0;
+    } else if (restoreleft && !c->parent) {
+        sessionclaim(c);
+    } else if (c->parent && c->parent->held) {
+        c->held = 1;  /* Dialogs appear with the window they belong to */
     }
-
-    /* Add the window to our list */
-    c = malloc(sizeof(Client));
-    if (!c) {
-        wm_log("Fatal: failed to allocate memory for new client\n");
+    if (!(c = manage(c)))
         return;
+    if (c->pid) {
+        procmapped(c);
+        cgroupmove(c);  /* Rules may have sent it elsewhere */
     }
-    c->win = ev->window;
-    c->next = clients;
-    c->isfloating = 0;
-    c->isfullscreen = 0;
-    c->workspace = current_workspace;
-    clients = c;
-    sel = c;
 
-    /* Set up window isolation */
-    XSetWindowAttributes swa;  // Changed variable name to swa
-    swa.event_mask = EnterWindowMask | KeyPressMask;
-    swa.override_redirect = True;  // Prevent direct window communication
-    swa.border_pixel = INACTIVE_BORDER;
-    XChangeWindowAttributes(dpy, ev->window,
-                          CWEventMask | CWOverrideRedirect | CWBorderPixel,
-                          &swa);
-
-    /* Set initial border width */
-    XSetWindowBorderWidth(dpy, ev->window, BORDER_WIDTH);
-
-    /* Isolate window from others except via clipboard */
-    XChangeProperty(dpy, ev->window,
-                   XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", False),
-                   XA_ATOM, 32, PropModeReplace,
-                   (unsigned char *) &clipboard, 1);
+    /* Restored windows wait unmapped until the whole session is back */
+    if (c->held) {
+        publishstate();
+        if (!restoreleft)
+            restoredone();
+        return;
+    }
 
-    /* Add mouse button grabs */
-    XGrabButton(dpy, Button1, MODKEY, ev->window, True,
-                ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
-                GrabModeAsync, GrabModeAsync, None, None);
+    /* Windows sent to a hidden workspace stay unmapped until it is shown */
+    if (!ISVISIBLE(c)) {
+        setvisible(c, 0);
+        publishstate();
+        return;
+    }
 
-    XMapWindow(dpy, ev->window);
+    /* Lay out before mapping so the window appears in its final place;
+     * floating windows such as dialogs leave the tiling untouched */
+    if (!c->isfloating || c->isfullscreen)
+        arrange(c->mon);
+    else
+        XMoveResizeWindow(dpy, c->win, c->x, c->y, c->w, c->h);
+    spatialsync(c);
+    setvisible(c, 1);
+    focus(c);
 
-    /* Handle child windows of fullscreen windows */
-    Client *fs = find_fullscreen();
-    if (fs) {
-        if (is_child_of_fullscreen(ev->window)) {
-            /* Child window of fullscreen window - keep on top */
-            XRaiseWindow(dpy, ev->window);
-        } else {
-            /* Not a child - keep fullscreen window on top */
+    /* Only transients of a fullscreen window may cover it */
+    Client *fs = find_fullscreen(c->mon);
+    if (fs && fs != c) {
+        Client *p;
+        for (p = c->parent; p && p != fs; p = p->parent);
+        if (!p) {
             XRaiseWindow(dpy, fs->win);
+            raisetransients(fs);
         }
     }
+}
 
-    arrange();
-    focus(sel);
+/* A press of the same key and modifiers */
+static int
+samekey(const XEvent *ev, const XKeyEvent *k)
+{
+    return ev->type == KeyPress && ev->xkey.keycode == k->keycode && ev->xkey.state == k->state;
 }
 
 void
@@ -326,13 +1900,48 @@ keypress(XEvent *e)
     KeySym keysym = XkbKeycodeToKeysym(dpy, ev->keycode, 0, 0);
     long unsigned int i;
     const char *const *args;  // Updated type to match keys[].arg
+    XEvent next;
+
+    /* With detectable auto-repeat a held key sends presses but one release */
+    int repeat = ev->keycode == heldkey;
+    heldkey = ev->keycode;
 
     for (i = 0; i < sizeof(keys)/sizeof(keys[0]); i++) {
         if (keysym == keys[i].keysym && keys[i].mod == ev->state && keys[i].func) {
+            watchdetail(keysym);
+            if (repeat && keys[i].repeat == RepeatIgnore) {
+                repeatsignored++;
+                return;
+            }
+            /* Take the repeats queued right behind this press and do them
+             * as one step, anything in between keeps them apart */
+            keysteps = 1;
+            if (keys[i].repeat == RepeatCoalesce)
+                while (XEventsQueued(dpy, QueuedAlready) > 0) {
+                    XPeekEvent(dpy, &next);
+                    if (!samekey(&next, ev))
+                        break;
+                    XNextEvent(dpy, &next);
+                    keysteps++;
+                    repeatscoalesced++;
+                    maskevents[MaskKeyGrab]++;
+                }
             args = keys[i].arg;
+            PROBE3(key_entry, keysym, ev->state, keysteps);
             keys[i].func((const char **)args);  // Cast to match function parameter type
+            PROBE1(key_return, keysym);
+            keysteps = 1;
+            return;
         }
     }
+    unboundkeys++;
+}
+
+void
+keyrelease(XEvent *e)
+{
+    if (e->xkey.keycode == heldkey)
+        heldkey = 0;
 }
 
 void
@@ -341,19 +1950,454 @@ destroynotify(XEvent *e)
     Client *c, *prev = NULL;
     XDestroyWindowEvent *ev = &e->xdestroywindow;
 
+#ifdef XFIXES
+    if (xfixes)
+        clipcancel(ev->window);
+#endif
     for (c = clients; c; prev = c, c = c->next) {
         if (c->win == ev->window) {
+            Monitor *m = c->mon;
             if (prev)
                 prev->next = c->next;
             else
                 clients = c->next;
             if (sel == c)
                 sel = clients;
+            if (scratch == c)
+                scratch = NULL;
+            /* The server drops its Damage object along with the window */
+            detachtransient(c);
+            spatialremove(c);
             free(c);
+            nclients--;
+            arrange(m);
             break;
         }
     }
-    arrange();
+}
+
+#ifdef XFIXES
+/* Selection manager
+ * The text of CLIPBOARD and PRIMARY is fetched whenever XFixes reports a
+ * new owner and kept in a bounded cache. A selection is only taken over
+ * once its owner goes away: while it runs, the owner serves every format
+ * it offers (HTML, images, file lists) and keeps PRIMARY highlighted; the
+ * cache only keeps the text. Large contents are received and served with
+ * the INCR protocol. */
+typedef struct {
+    int refs;                   /* Cache entry and transfers using it */
+    unsigned long len;
+    unsigned char data[];
+} ClipData;
+
+typedef struct {
+    Atom sel;
+    ClipData *data;             /* Cached text, NULL if none */
+    Time time;                  /* When the cached contents were set */
+    int owned;                  /* We are the selection owner */
+    unsigned char *in;          /* Contents being received */
+    unsigned long inlen;
+    int incr;                   /* Receiving with INCR */
+    int overflow;               /* Too large for the cache, draining */
+    struct timespec fetch;
+} Clip;
+
+/* An INCR transfer to a requestor */
+typedef struct Transfer {
+    Window req;
+    Atom prop, type;
+    ClipData *data;
+    unsigned long off;
+    int selected;               /* We selected PropertyChangeMask on req */
+    struct Transfer *next;
+} Transfer;
+
+static Clip clips[2];
+static Transfer *transfers = NULL;
+static Window selwin = None;
+static unsigned long clipchunk;    /* Largest property written at once */
+static unsigned long clipserved = 0, clipincr = 0, clipfetched = 0;
+
+static void
+clipunref(ClipData *d)
+{
+    if (d && --d->refs == 0)
+        free(d);
+}
+
+static Clip *
+getclip(Atom sel)
+{
+    for (int i = 0; i < 2; i++)
+        if (clips[i].sel == sel)
+            return &clips[i];
+    return NULL;
+}
+
+static void
+setupclipboard(void)
+{
+    int errbase;
+
+    if (!XFixesQueryExtension(dpy, &xfixesevbase, &errbase))
+        return;
+    xfixes = 1;
+    clips[0].sel = clipboard;
+    clips[1].sel = primary_selection;
+    clipchunk = (XExtendedMaxRequestSize(dpy) ? XExtendedMaxRequestSize(dpy)
+                                              : XMaxRequestSize(dpy)) * 4 - 1024;
+    if (clipchunk > 256 * 1024)
+        clipchunk = 256 * 1024;
+    selwin = XCreateSimpleWindow(dpy, root, -1, -1, 1, 1, 0, 0, 0);
+    XSelectInput(dpy, selwin, PropertyChangeMask);
+    for (int i = 0; i < 2; i++)
+        XFixesSelectSelectionInput(dpy, root, clips[i].sel,
+                                   XFixesSetSelectionOwnerNotifyMask |
+                                   XFixesSelectionWindowDestroyNotifyMask |
+                                   XFixesSelectionClientCloseNotifyMask);
+}
+
+static void
+clipown(Clip *cl)
+{
+    if (!cl->data || cl->owned)
+        return;
+    XSetSelectionOwner(dpy, cl->sel, selwin, cl->time);
+    cl->owned = 1;
+}
+
+/* Received contents replace the cache */
+static void
+clipstore(Clip *cl)
+{
+    ClipData *d;
+
+    if (cl->overflow || !(d = malloc(sizeof(ClipData) + cl->inlen))) {
+        wm_log("Selection %s not cached (%lu bytes)\n",
+               cl->sel == clipboard ? "CLIPBOARD" : "PRIMARY", cl->inlen);
+    } else {
+        d->refs = 1;
+        d->len = cl->inlen;
+        memcpy(d->data, cl->in, cl->inlen);
+        clipunref(cl->data);
+        cl->data = d;
+        clipfetched++;
+        wm_log("Cached %lu bytes of %s in %.1fms\n", d->len,
+               cl->sel == clipboard ? "CLIPBOARD" : "PRIMARY", elapsed_ms(&cl->fetch));
+    }
+    free(cl->in);
+    cl->in = NULL;
+    cl->inlen = 0;
+    cl->incr = cl->overflow = 0;
+}
+
+static void
+clipappend(Clip *cl, const unsigned char *v, unsigned long len)
+{
+    unsigned char *in;
+
+    if (cl->overflow || !len)
+        return;
+    if (cl->inlen + len > CLIPBOARD_MAX_BYTES || !(in = realloc(cl->in, cl->inlen + len))) {
+        cl->overflow = 1;
+        return;
+    }
+    memcpy(in + cl->inlen, v, len);
+    cl->in = in;
+    cl->inlen += len;
+}
+
+/* Read (and delete) the property a conversion or INCR chunk landed in.
+ * Returns the number of bytes appended, -1 when the owner started INCR. */
+static long
+clipread(Clip *cl)
+{
+    Atom type;
+    int format;
+    unsigned long n, after;
+    unsigned char *v = NULL;
+    long len;
+
+    if (XGetWindowProperty(dpy, selwin, cl->sel, 0, CLIPBOARD_MAX_BYTES / 4 + 1, True,
+                           AnyPropertyType, &type, &format, &n, &after, &v) != Success)
+        return 0;
+    if (type == atom[Incr]) {
+        XFree(v);
+        return -1;
+    }
+    len = n * (format / 8);
+    /* The server only deletes a property that was read whole, and an INCR
+     * owner waits for the delete before sending the next chunk */
+    if (after) {
+        cl->overflow = 1;
+        XDeleteProperty(dpy, selwin, cl->sel);
+    }
+    clipappend(cl, v, len);
+    XFree(v);
+    return len;
+}
+
+/* The owner answered our ConvertSelection */
+static void
+selectionnotify(XEvent *e)
+{
+    XSelectionEvent *ev = &e->xselection;
+    Clip *cl;
+
+    if (ev->requestor != selwin || !(cl = getclip(ev->selection)))
+        return;
+    free(cl->in);
+    cl->in = NULL;
+    cl->inlen = 0;
+    cl->incr = cl->overflow = 0;
+    if (ev->property == None) {
+        /* Not text: forget what we had so we never paste stale data */
+        clipunref(cl->data);
+        cl->data = NULL;
+        return;
+    }
+    if (clipread(cl) < 0)
+        cl->incr = 1;  /* Deleting the INCR property asked for the first chunk */
+    else
+        clipstore(cl);
+}
+
+/* A new owner, or the owner went away */
+static void
+xfixesnotify(XEvent *e)
+{
+    XFixesSelectionNotifyEvent *ev = (XFixesSelectionNotifyEvent *)e;
+    Clip *cl = getclip(ev->selection);
+
+    if (!cl || ev->owner == selwin)
+        return;
+    cl->owned = 0;
+    if (ev->owner == None) {
+        /* Keep the last contents available after their source exited */
+        cl->time = ev->timestamp;
+        clipown(cl);
+        return;
+    }
+    cl->time = ev->selection_timestamp;
+    clock_gettime(CLOCK_MONOTONIC, &cl->fetch);
+    XConvertSelection(dpy, cl->sel, atom[UTF8String], cl->sel, selwin, ev->timestamp);
+}
+
+static void
+selectionclear(XEvent *e)
+{
+    Clip *cl = getclip(e->xselectionclear.selection);
+
+    if (cl)
+        cl->owned = 0;
+}
+
+static void
+transferdone(Transfer *t)
+{
+    Transfer **tp;
+
+    for (tp = &transfers; *tp && *tp != t; tp = &(*tp)->next);
+    if (*tp)
+        *tp = t->next;
+    if (t->selected)
+        XSelectInput(dpy, t->req, NoEventMask);
+    clipunref(t->data);
+    free(t);
+}
+
+/* Forget transfers to a window that went away */
+static void
+clipcancel(Window w)
+{
+    Transfer *t, *next;
+
+    for (t = transfers; t; t = next) {
+        next = t->next;
+        if (t->req == w) {
+            t->selected = 0;
+            transferdone(t);
+        }
+    }
+}
+
+/* The cached UTF-8 text as Latin-1 for STRING requestors, '?' where it
+ * has no equivalent. The copy starts with one reference. */
+static ClipData *
+cliplatin1(const ClipData *d)
+{
+    ClipData *l;
+    unsigned long i, n = 0;
+
+    if (!(l = malloc(sizeof(ClipData) + d->len)))
+        return NULL;
+    l->refs = 1;
+    for (i = 0; i < d->len; i++) {
+        unsigned char b = d->data[i];
+        if (b < 0x80) {
+            l->data[n++] = b;
+        } else if ((b == 0xc2 || b == 0xc3) && i + 1 < d->len &&
+                   (d->data[i + 1] & 0xc0) == 0x80) {
+            l->data[n++] = ((b & 0x03) << 6) | (d->data[++i] & 0x3f);
+        } else if ((b & 0xc0) != 0x80) {
+            l->data[n++] = '?';  /* Lead byte of a character beyond U+00FF */
+        }
+    }
+    l->len = n;
+    return l;
+}
+
+/* Answer a paste from the cache */
+static void
+selectionrequest(XEvent *e)
+{
+    XSelectionRequestEvent *ev = &e->xselectionrequest;
+    XSelectionEvent re = { 0 };
+    Clip *cl = getclip(ev->selection);
+    Atom prop = ev->property != None ? ev->property : ev->target;
+
+    re.type = SelectionNotify;
+    re.display = dpy;
+    re.requestor = ev->requestor;
+    re.selection = ev->selection;
+    re.target = ev->target;
+    re.time = ev->time;
+    re.property = None;
+
+    if (cl && cl->owned && cl->data) {
+        if (ev->target == atom[Targets]) {
+            Atom t[] = { atom[Targets], atom[Timestamp], atom[UTF8String], XA_STRING, atom[Text] };
+            XChangeProperty(dpy, ev->requestor, prop, XA_ATOM, 32, PropModeReplace,
+                            (unsigned char *)t, sizeof(t) / sizeof(t[0]));
+            re.property = prop;
+        } else if (ev->target == atom[Timestamp]) {
+            long t = cl->time;
+            XChangeProperty(dpy, ev->requestor, prop, XA_INTEGER, 32, PropModeReplace,
+                            (unsigned char *)&t, 1);
+            re.property = prop;
+        } else if (ev->target == atom[UTF8String] || ev->target == XA_STRING ||
+                   ev->target == atom[Text]) {
+            Atom type = ev->target == atom[Text] ? atom[UTF8String] : ev->target;
+            ClipData *d = cl->data;
+            Transfer *t;
+            if (type == XA_STRING)
+                d = cliplatin1(cl->data);
+            else
+                d->refs++;
+            if (!d) {
+                /* Refused below */
+            } else if (d->len <= clipchunk) {
+                XChangeProperty(dpy, ev->requestor, prop, type, 8, PropModeReplace,
+                                d->data, d->len);
+                re.property = prop;
+            } else if ((t = calloc(1, sizeof(Transfer)))) {
+                /* INCR: announce the size, then a chunk per property delete */
+                long size = d->len;
+                t->req = ev->requestor;
+                t->prop = prop;
+                t->type = type;
+                t->data = d;
+                t->data->refs++;
+                if (!wintoclient(t->req)) {
+                    XSelectInput(dpy, t->req, PropertyChangeMask);
+                    t->selected = 1;
+                }
+                t->next = transfers;
+                transfers = t;
+                XChangeProperty(dpy, ev->requestor, prop, atom[Incr], 32, PropModeReplace,
+                                (unsigned char *)&size, 1);
+                re.property = prop;
+                clipincr++;
+            }
+            clipunref(d);
+        }
+        if (re.property != None)
+            clipserved++;
+    }
+    XSendEvent(dpy, ev->requestor, False, NoEventMask, (XEvent *)&re);
+}
+
+/* INCR progress on either side. Returns 1 if the event was ours. */
+static int
+clipproperty(XPropertyEvent *ev)
+{
+    Transfer *t;
+    Clip *cl;
+
+    if (ev->window == selwin) {
+        if (ev->state == PropertyNewValue && (cl = getclip(ev->atom)) && cl->incr &&
+            clipread(cl) == 0)
+            clipstore(cl);  /* A zero-length chunk ends the transfer */
+        return 1;
+    }
+    if (ev->state != PropertyDelete)
+        return 0;
+    for (t = transfers; t; t = t->next) {
+        if (t->req != ev->window || t->prop != ev->atom)
+            continue;
+        unsigned long n = t->data->len - t->off;
+        if (n > clipchunk)
+            n = clipchunk;
+        XChangeProperty(dpy, t->req, t->prop, t->type, 8, PropModeReplace,
+                        t->data->data + t->off, n);
+        t->off += n;
+        if (n == 0)
+            transferdone(t);
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+/* Tell a client its current geometry, ICCCM 4.1.5 */
+static void
+sendconfigure(Client *c)
+{
+    XConfigureEvent ce = { 0 };
+
+    ce.type = ConfigureNotify;
+    ce.display = dpy;
+    ce.event = c->win;
+    ce.window = c->win;
+    ce.x = c->x;
+    ce.y = c->y;
+    ce.width = c->w;
+    ce.height = c->h;
+    ce.border_width = c->isfullscreen ? 0 : BORDER_WIDTH;
+    ce.above = None;
+    ce.override_redirect = False;
+    XSendEvent(dpy, c->win, False, StructureNotifyMask, (XEvent *)&ce);
+}
+
+/* Refresh the cached size hints, relaying out if they changed */
+void
+propertynotify(XEvent *e)
+{
+    XPropertyEvent *ev = &e->xproperty;
+    XSizeHints sh;
+    long supplied;
+    Client *c;
+
+#ifdef XFIXES
+    if (xfixes && clipproperty(ev))
+        return;
+#endif
+    if (!(c = wintoclient(ev->window)))
+        return;
+    /* Titles are only read again when the bar shows them */
+    if (ev->atom == atom[NetWMName] || ev->atom == XA_WM_NAME) {
+        c->titlestale = 1;
+        if (barh && c == sel)
+            drawbar(c->mon);
+        return;
+    }
+    if (ev->atom != XA_WM_NORMAL_HINTS)
+        return;
+    if (!XGetWMNormalHints(dpy, c->win, &sh, &supplied))
+        sh.flags = 0;
+    updatesizehints(c, &sh);
+    if (ISVISIBLE(c) && !c->isfloating && !c->isfullscreen)
+        arrange(c->mon);
 }
 
 void
@@ -362,6 +2406,7 @@ configurerequest(XEvent *e)
     if (!e) return;
     XConfigureRequestEvent *ev = &e->xconfigurerequest;
     XWindowChanges wc;
+    Client *c;
 
     /* Validate requested dimensions */
     if (!validate_window_size(ev->width, ev->height)) {
@@ -375,6 +2420,25 @@ configurerequest(XEvent *e)
         return;
     }
 
+    /* Tiled and fullscreen windows keep the size the layout gave them; a
+     * synthetic ConfigureNotify tells them so without touching the window */
+    if ((c = wintoclient(ev->window))) {
+        if (!c->isfloating || c->isfullscreen) {
+            sendconfigure(c);
+            return;
+        }
+        if (ev->value_mask & CWX)
+            c->x = ev->x;
+        if (ev->value_mask & CWY)
+            c->y = ev->y;
+        if (ev->value_mask & CWWidth)
+            c->w = ev->width;
+        if (ev->value_mask & CWHeight)
+            c->h = ev->height;
+        resize(c, c->x, c->y, c->w, c->h);
+        return;
+    }
+
     wc.x = ev->x;
     wc.y = ev->y;
     wc.width = ev->width;
@@ -392,17 +2456,27 @@ focus(Client *c)
     int visible = 0;
     if (!c)
         return;
+    PROBE2(focus_entry, c->win, c->workspace);
+
+    /* Monocle: swap the shown tiled window for this one, one unmap and one map */
+    if (c->hidden) {
+        for (i = clients; i; i = i->next)
+            if (i != c && i->mon == c->mon && ISVISIBLE(i) && !i->hidden &&
+                !i->isfloating && !i->isfullscreen)
+                sethidden(i, 1);
+        sethidden(c, 0);
+    }
 
     /* Count visible windows in workspace */
     for (i = clients; i; i = i->next)
-        if (i->workspace == current_workspace)
+        if (i->mon == c->mon && ISVISIBLE(i) && !i->hidden)
             visible++;
 
     /* Set borders only if more than one window and not fullscreen */
     if (visible > 1 && !c->isfullscreen) {
         /* Set all windows to inactive border */
         for (i = clients; i; i = i->next) {
-            if (i->workspace == current_workspace) {
+            if (i->mon == c->mon && ISVISIBLE(i)) {
                 XSetWindowBorderWidth(dpy, i->win, BORDER_WIDTH);
                 XSetWindowBorder(dpy, i->win, INACTIVE_BORDER);
             }
@@ -416,43 +2490,137 @@ focus(Client *c)
     }
 
     sel = c;
+    selmon = c->mon;
+    c->raised = ++raiseseq;
     XSetInputFocus(dpy, c->win, RevertToParent, CurrentTime);
     XRaiseWindow(dpy, c->win);
+    raisetransients(c);
+    publishstate();
+    PROBE1(focus_return, c->win);
 }
 
 void
-arrange(void)
+arrange(Monitor *m)
 {
-    Client *c;
-    Client *master = NULL;  // Add this declaration
-    int n = 0, visible = 0;
+    PROBE3(arrange_entry, m ? m->num : -1, m ? m->workspace : 0, nclients);
+    if (m)
+        applylayout(m);
+    else
+        for (Monitor *i = mons; i; i = i->next)
+            applylayout(i);
+    /* Floating and hidden clients may have changed workspace or monitor */
+    for (Client *c = clients; c; c = c->next)
+        if (!m || c->mon == m)
+            spatialsync(c);
+    publishstate();
+    PROBE1(arrange_return, m ? m->num : -1);
+}
+
+/* Fit a size to the client's WM_NORMAL_HINTS, as in ICCCM 4.1.2.3 */
+static void
+applysizehints(Client *c, int *w, int *h)
+{
+    int baseismin = c->basew == c->minw && c->baseh == c->minh;
+
+    /* The base size is not part of the aspect ratio unless it is the minimum */
+    if (!baseismin) {
+        *w -= c->basew;
+        *h -= c->baseh;
+    }
+    if (c->mina > 0 && c->maxa > 0 && *w > 0 && *h > 0) {
+        if (c->maxa < (float)*w / *h)
+            *w = *h * c->maxa + 0.5;
+        else if (c->mina < (float)*h / *w)
+            *h = *w * c->mina + 0.5;
+    }
+    if (baseismin) {
+        *w -= c->basew;
+        *h -= c->baseh;
+    }
+    if (c->incw > 0)
+        *w -= *w % c->incw;
+    if (c->inch > 0)
+        *h -= *h % c->inch;
+    *w += c->basew;
+    *h += c->baseh;
+    if (*w < c->minw)
+        *w = c->minw;
+    if (*h < c->minh)
+        *h = c->minh;
+    if (c->maxw > 0 && *w > c->maxw)
+        *w = c->maxw;
+    if (c->maxh > 0 && *h > c->maxh)
+        *h = c->maxh;
+    if (*w < 1)
+        *w = 1;
+    if (*h < 1)
+        *h = 1;
+}
+
+/* Move and resize a client, remembering the geometry it was given.
+ * The size honors the client's hints so it has no reason to ask again. */
+static void
+resize(Client *c, int x, int y, int w, int h)
+{
+    applysizehints(c, &w, &h);
+    c->x = x;
+    c->y = y;
+    c->w = w;
+    c->h = h;
+    XMoveResizeWindow(dpy, c->win, x, y, w, h);
+    spatialsync(c);
+}
+
+/* Lay out the workspace shown on a monitor with its layout */
+static void
+applylayout(Monitor *m)
+{
+    Client *c, *shown = NULL;
+    WMLayoutParams p;
+    WMRect *r;
+    int n = 0, visible = 0, i;
+
+    /* Monocle shows the focused tiled window, or the one focused last */
+    if (m->lt[m->workspace]->monocle) {
+        for (c = clients; c; c = c->next)
+            if (c->mon == m && ISVISIBLE(c) && !c->isfloating && !c->isfullscreen &&
+                (!shown || c->raised > shown->raised))
+                shown = c;
+        if (sel && sel->mon == m && ISVISIBLE(sel) && !sel->isfloating && !sel->isfullscreen)
+            shown = sel;
+    }
+    for (c = clients; c; c = c->next)
+        if (c->mon == m && ISVISIBLE(c) &&
+            c->hidden != (shown && c != shown && !c->isfloating && !c->isfullscreen))
+            sethidden(c, !c->hidden);
 
     /* First pass: count windows and reset positions */
     for (c = clients; c; c = c->next) {
-        if (c->workspace == current_workspace) {
+        if (c->mon == m && ISVISIBLE(c)) {
             if (!c->isfloating && !c->isfullscreen)
                 n++;
-            visible++;
+            visible += !c->hidden;
             
             /* Reset any invalid positions */
-            if (c->x < -BORDER_WIDTH || c->y < -BORDER_WIDTH ||
-                c->x > attr.width || c->y > attr.height) {
-                c->x = GAP_WIDTH;
-                c->y = GAP_WIDTH;
+            if (c->x < m->mx - BORDER_WIDTH || c->y < m->my - BORDER_WIDTH ||
+                c->x > m->mx + m->mw || c->y > m->my + m->mh) {
+                c->x = m->wx + GAP_WIDTH;
+                c->y = m->wy + GAP_WIDTH;
             }
         }
     }
 
     /* Handle fullscreen windows first */
-    Client *fs = find_fullscreen();
+    Client *fs = find_fullscreen(m);
     if (fs) {
         XSetWindowBorderWidth(dpy, fs->win, 0);
-        XMoveResizeWindow(dpy, fs->win, 0, 0, attr.width, attr.height);
+        XMoveResizeWindow(dpy, fs->win, m->mx, m->my, m->mw, m->mh);
         XRaiseWindow(dpy, fs->win);
+        raisetransients(fs);
         
         /* Hide other windows in this workspace */
         for (c = clients; c; c = c->next) {
-            if (c != fs && c->workspace == current_workspace) {
+            if (c != fs && c->mon == m && ISVISIBLE(c)) {
                 XMoveWindow(dpy, c->win, c->x, c->y);
                 XLowerWindow(dpy, c->win);
             }
@@ -460,133 +2628,1022 @@ arrange(void)
         return;
     }
 
-    /* If only one visible window, make it fullscreen without borders */
-    if (visible == 1) {
-        for (c = clients; c; c = c->next) {
-            if (c->workspace == current_workspace) {
-                XSetWindowBorderWidth(dpy, c->win, 0);
-                XMoveResizeWindow(dpy, c->win, 0, 0, attr.width, attr.height);
-                break;
-            }
-        }
+    /* If only one visible window, make it fullscreen without borders.
+     * Under monocle the unmapped ones get the same area, so showing one of
+     * them later only maps it. */
+    if (visible == 1) {
+        for (c = clients; c; c = c->next) {
+            if (c->mon != m || !ISVISIBLE(c))
+                continue;
+            if (!c->hidden)
+                XSetWindowBorderWidth(dpy, c->win, 0);
+            resize(c, m->wx, m->wy, m->ww, m->wh);
+        }
+        return;
+    }
+
+    if (n == 0)
+        return;
+
+    p.n = n;
+    p.area.x = m->wx;
+    p.area.y = m->wy;
+    p.area.w = m->ww;
+    p.area.h = m->wh;
+    p.mfact = m->mfact;
+    p.gap = GAP_WIDTH;
+    p.border = BORDER_WIDTH;
+    if (!(r = calloc(n, sizeof(WMRect)))) {
+        wm_log("Failed to allocate memory for layout of %d windows\n", n);
+        return;
+    }
+    m->lt[m->workspace]->l->arrange(&p, r);
+
+    /* Tiled windows in list order, the first is the master */
+    for (i = 0, c = clients; c && i < n; c = c->next) {
+        if (c->isfloating || c->isfullscreen || c->mon != m || !ISVISIBLE(c))
+            continue;
+        /* Monocle windows are resized while unmapped so focusing one only maps it */
+        resize(c, r[i].x, r[i].y, r[i].w > 0 ? r[i].w : 1, r[i].h > 0 ? r[i].h : 1);
+        if (!c->hidden) {
+            XRaiseWindow(dpy, c->win);
+            raisetransients(c);
+        }
+        i++;
+    }
+    free(r);
+}
+
+/* Switch the current workspace to a built-in layout or a plugin */
+void
+setlayout(const char **arg)
+{
+    struct timespec t0;
+    Layout *lt;
+
+    if (!arg || !arg[0])
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (!(lt = getlayout(arg[0])))
+        return;
+    releaselayout(selmon->lt[selmon->workspace]);
+    selmon->lt[selmon->workspace] = lt;
+    wm_log("Workspace %d now uses layout %s, switch took %.3fms\n",
+           selmon->workspace, lt->l->name, elapsed_ms(&t0));
+    arrange(selmon);
+}
+
+/* Reopen every loaded plugin to pick up rebuilt layouts. Install new
+ * versions by renaming over the old file, never by writing into it. */
+void
+reloadlayouts(const char **arg __attribute__((unused)))
+{
+    struct timespec t0;
+    Layout *lt, **lp;
+    Monitor *m;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (lp = &layouts; (lt = *lp);) {
+        if (!lt->handle) {
+            lp = &lt->next;
+            continue;
+        }
+        dlclose(lt->handle);
+        if (openlayout(lt)) {
+            lp = &lt->next;
+            continue;
+        }
+        /* Workspaces of a plugin that failed to reload fall back to tile */
+        for (m = mons; m; m = m->next)
+            for (i = 1; i <= 9; i++)
+                if (m->lt[i] == lt) {
+                    m->lt[i] = &tilelayout;
+                    tilelayout.refs++;
+                }
+        *lp = lt->next;
+        free(lt);
+    }
+    wm_log("Reloaded layouts in %.3fms\n", elapsed_ms(&t0));
+    arrange(NULL);
+}
+
+void
+focusnext(const char **arg __attribute__((unused)))
+{
+    Client *c, *next = sel;
+    if (!sel)
+        return;
+    /* Only cycle through windows shown on the focused monitor */
+    for (int step = 0; step < keysteps; step++) {
+        for (c = next->next; c && !(c->mon == sel->mon && ISVISIBLE(c)); c = c->next);
+        if (!c)
+            break;
+        next = c;
+    }
+    if (next != sel)
+        focus(next);
+}
+
+void
+focusprev(const char **arg __attribute__((unused)))
+{
+    Client *c, *prev = NULL, *cur = sel;
+    if (!sel || !clients)
+        return;
+    for (int step = 0; step < keysteps; step++, cur = prev) {
+        prev = NULL;
+        for (c = clients; c && c != cur; c = c->next)
+            if (c->mon == sel->mon && ISVISIBLE(c))
+                prev = c;
+        /* Wrap around to the last visible window */
+        if (!prev)
+            for (c = cur->next; c; c = c->next)
+                if (c->mon == sel->mon && ISVISIBLE(c))
+                    prev = c;
+        if (!prev)
+            break;
+    }
+    if (prev && prev != sel)
+        focus(prev);
+}
+
+/* Child process supervisor
+ * Spawned commands are reaped from the event loop through a signalfd, and
+ * their runtime, exit status and time to first window are kept per command. */
+#define MAXCMDS   32
+
+typedef struct {
+    char cmd[64];               /* Command line, truncated */
+    unsigned int launches, running, failed, maps;
+    double total_ms, max_ms;    /* Process runtime */
+    double map_ms, map_max_ms;  /* Spawn to first mapped window */
+} CmdStat;
+
+typedef struct Proc {
+    pid_t pid;
+    CmdStat *stat;
+    struct timespec start;
+    int mapped;                 /* First window already seen */
+    struct Proc *next;
+} Proc;
+
+static CmdStat cmdstats[MAXCMDS];
+static int ncmdstats = 0;
+static Proc *procs = NULL;
+static unsigned int unknownreaped = 0;  /* Children inherited across reload */
+
+static CmdStat *
+cmdstat(const char **arg)
+{
+    char cmd[64];
+    size_t len = 0;
+    int i;
+
+    cmd[0] = '\0';
+    for (i = 0; arg[i] && len < sizeof(cmd) - 1; i++)
+        len += snprintf(cmd + len, sizeof(cmd) - len, i ? " %s" : "%s", arg[i]);
+
+    for (i = 0; i < ncmdstats; i++)
+        if (!strcmp(cmdstats[i].cmd, cmd))
+            return &cmdstats[i];
+    if (ncmdstats == MAXCMDS)
+        return NULL;
+    snprintf(cmdstats[ncmdstats].cmd, sizeof(cmdstats[ncmdstats].cmd), "%s", cmd);
+    return &cmdstats[ncmdstats++];
+}
+
+static void
+procstart(pid_t pid, const char **arg)
+{
+    Proc *p = calloc(1, sizeof(Proc));
+    if (!p) {
+        wm_log("Failed to allocate memory to track child %d\n", pid);
+        return;
+    }
+    p->pid = pid;
+    p->stat = cmdstat(arg);
+    clock_gettime(CLOCK_MONOTONIC, &p->start);
+    if (p->stat) {
+        p->stat->launches++;
+        p->stat->running++;
+    }
+    p->next = procs;
+    procs = p;
+}
+
+static pid_t
+parentpid(pid_t pid)
+{
+    char path[64], buf[512], *s;
+    FILE *f;
+    int ppid = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if (!(f = fopen(path, "r")))
+        return 0;
+    if (fgets(buf, sizeof(buf), f) && (s = strrchr(buf, ')')))
+        sscanf(s + 2, "%*c %d", &ppid);
+    fclose(f);
+    return ppid;
+}
+
+/* Match a newly mapped window to the spawn that launched it */
+static void
+procmapped(Client *c)
+{
+    pid_t pid = c->pid;
+    Proc *p;
+
+    /* _NET_WM_PID may belong to a process forked by a wrapper script */
+    for (int depth = 0; pid > 1 && depth < 4; depth++, pid = parentpid(pid)) {
+        for (p = procs; p; p = p->next) {
+            if (p->pid != pid)
+                continue;
+            if (!p->mapped && p->stat) {
+                double ms = elapsed_ms(&p->start);
+                p->mapped = 1;
+                p->stat->maps++;
+                p->stat->map_ms += ms;
+                if (ms > p->stat->map_max_ms)
+                    p->stat->map_max_ms = ms;
+                wm_log("Launch of %s mapped window 0x%lx after %.1fms\n",
+                       p->stat->cmd, c->win, ms);
+            }
+            return;
+        }
+    }
+}
+
+/* Reap every exited child without blocking */
+static void
+reap(void)
+{
+    Proc *p, **pp;
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (pp = &procs; *pp && (*pp)->pid != pid; pp = &(*pp)->next);
+        if (!(p = *pp)) {
+            unknownreaped++;
+            continue;
+        }
+        *pp = p->next;
+
+        double ms = elapsed_ms(&p->start);
+        int failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        if (p->stat) {
+            p->stat->running--;
+            p->stat->failed += failed;
+            p->stat->total_ms += ms;
+            if (ms > p->stat->max_ms)
+                p->stat->max_ms = ms;
+        }
+        if (WIFEXITED(status))
+            wm_log("Child %d (%s) exited with %d after %.1fms\n", pid,
+                   p->stat ? p->stat->cmd : "?", WEXITSTATUS(status), ms);
+        else
+            wm_log("Child %d (%s) killed by signal %d after %.1fms\n", pid,
+                   p->stat ? p->stat->cmd : "?", WTERMSIG(status), ms);
+        free(p);
+    }
+}
+
+#ifdef XRES
+/* X server resource accounting
+ * Every XRES_INTERVAL_S, and before the statistics are written on request,
+ * the X-Resource extension is asked for the pixmap bytes, window and pixmap
+ * counts and PID of every X client. Each client's usage is charged to its
+ * first managed window so workspace totals follow the window around. */
+
+static void
+setupxres(void)
+{
+    const xcb_query_extension_reply_t *ext = xcb_get_extension_data(xc, &xcb_res_id);
+    xcb_res_query_version_reply_t *ver = NULL;
+    struct itimerspec its = { { XRES_INTERVAL_S, 0 }, { XRES_INTERVAL_S, 0 } };
+
+    if (!ext || !ext->present ||
+        !(ver = xcb_res_query_version_reply(xc, xcb_res_query_version(xc, 1, 2), NULL))) {
+        wm_log("X-Resource extension not available, no resource accounting\n");
+        return;
+    }
+    xres = 1;
+    xresminor = ver->server_major > 1 ? 2 : ver->server_minor;
+    free(ver);
+    xreswindow = XInternAtom(dpy, "WINDOW", False);
+    xrespixmap = XInternAtom(dpy, "PIXMAP", False);
+
+    if (XRES_INTERVAL_S <= 0 || replaying)
+        return;
+    xrestimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (xrestimer < 0 || timerfd_settime(xrestimer, 0, &its, NULL) < 0) {
+        wm_log("Cannot start the resource accounting timer: %s\n", strerror(errno));
+        if (xrestimer >= 0)
+            close(xrestimer);
+        xrestimer = -1;
+    }
+}
+
+static int
+xrescmp(const void *a, const void *b)
+{
+    const XResUsage *ua = a, *ub = b;
+    return ua->bytes < ub->bytes ? 1 : ua->bytes > ub->bytes ? -1 : 0;
+}
+
+/* Sample every X client. All queries are sent on the xcb connection before
+ * the first reply is awaited, so a sample costs two round trips however
+ * many clients there are: one for the client list, one for the rest. */
+static void
+xressample(void)
+{
+    xcb_res_query_clients_reply_t *cr;
+    xcb_res_client_t *xcl;
+    xcb_res_query_client_pixmap_bytes_cookie_t *bc = NULL;
+    xcb_res_query_client_resources_cookie_t *rc = NULL;
+    xcb_res_query_client_ids_cookie_t ic = { 0 };
+    xcb_res_query_client_ids_reply_t *ir;
+    xcb_res_client_id_spec_t *specs = NULL;
+    xcb_generic_error_t *err;
+    XResUsage *u = NULL;
+    Client *c;
+    struct timespec t0;
+    int n, i, j;
+
+    if (!xres)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    xcb_res_query_clients_cookie_t cc = xcb_res_query_clients(xc);
+    xcsent(cc.sequence);
+    if (!(cr = xcb_res_query_clients_reply(xc, cc, &err))) {
+        free(err);
+        return;
+    }
+    n = xcb_res_query_clients_clients_length(cr);
+    xcl = xcb_res_query_clients_clients(cr);
+    if (!(u = calloc(n ? n : 1, sizeof(XResUsage))) || !(bc = calloc(n ? n : 1, sizeof(*bc))) ||
+        !(rc = calloc(n ? n : 1, sizeof(*rc))) || !(specs = calloc(n ? n : 1, sizeof(*specs)))) {
+        wm_log("Failed to allocate memory for %d X clients\n", n);
+        free(u);
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        u[i].base = xcl[i].resource_base;
+        u[i].mask = xcl[i].resource_mask;
+        bc[i] = xcb_res_query_client_pixmap_bytes(xc, u[i].base);
+        rc[i] = xcb_res_query_client_resources(xc, u[i].base);
+        specs[i].client = u[i].base;
+        specs[i].mask = XCB_RES_CLIENT_ID_MASK_LOCAL_CLIENT_PID;
+    }
+    if (xresminor >= 2) {
+        ic = xcb_res_query_client_ids(xc, n, specs);
+        xcsent(ic.sequence);
+    } else if (n) {
+        xcsent(rc[n - 1].sequence);
+    }
+    xcb_flush(xc);
+
+    for (i = 0; i < n; i++) {
+        xcb_res_query_client_pixmap_bytes_reply_t *br;
+        xcb_res_query_client_resources_reply_t *rr;
+
+        /* Clients that left meanwhile answer with an error */
+        if ((br = xcb_res_query_client_pixmap_bytes_reply(xc, bc[i], &err))) {
+            u[i].bytes = br->bytes | (unsigned long)br->bytes_overflow << 32;
+            free(br);
+        } else {
+            free(err);
+        }
+        if ((rr = xcb_res_query_client_resources_reply(xc, rc[i], &err))) {
+            xcb_res_type_t *types = xcb_res_query_client_resources_types(rr);
+            for (j = 0; j < xcb_res_query_client_resources_types_length(rr); j++) {
+                if (types[j].resource_type == xreswindow)
+                    u[i].windows = types[j].count;
+                else if (types[j].resource_type == xrespixmap)
+                    u[i].pixmaps = types[j].count;
+            }
+            free(rr);
+        } else {
+            free(err);
+        }
+        for (j = 0; j < nxresusage; j++)
+            if (xresusage[j].base == u[i].base) {
+                u[i].prevbytes = xresusage[j].bytes;
+                break;
+            }
+    }
+    if (xresminor >= 2) {
+        if ((ir = xcb_res_query_client_ids_reply(xc, ic, &err))) {
+            xcb_res_client_id_value_iterator_t it;
+            for (it = xcb_res_query_client_ids_ids_iterator(ir); it.rem;
+                 xcb_res_client_id_value_next(&it)) {
+                if (!(it.data->spec.mask & XCB_RES_CLIENT_ID_MASK_LOCAL_CLIENT_PID) ||
+                    xcb_res_client_id_value_value_length(it.data) < 1)
+                    continue;
+                for (i = 0; i < n; i++)
+                    if ((it.data->spec.client & ~u[i].mask) == u[i].base)
+                        u[i].pid = *xcb_res_client_id_value_value(it.data);
+            }
+            free(ir);
+        } else {
+            free(err);
+        }
+    }
+
+    for (c = clients; c; c = c->next) {
+        c->xresbytes = 0;
+        c->xreswindows = 0;
+        for (i = 0; i < n && (c->win & ~u[i].mask) != u[i].base; i++);
+        if (i == n)
+            continue;
+        if (!c->pid)
+            c->pid = u[i].pid;
+        if (u[i].win == None) {
+            u[i].win = c->win;
+            c->xresbytes = u[i].bytes;
+            c->xreswindows = u[i].windows;
+        }
+    }
+
+    qsort(u, n, sizeof(XResUsage), xrescmp);
+    free(xresusage);
+    xresusage = u;
+    nxresusage = n;
+    xressamples++;
+    xresms = elapsed_ms(&t0);
+out:
+    free(bc);
+    free(rc);
+    free(specs);
+    free(cr);
+}
+
+/* Timer expiry: take a sample and publish it */
+static void
+xrestick(void)
+{
+    uint64_t expirations;
+
+    if (read(xrestimer, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+    xressample();
+    publishstate();
+}
+
+static void
+writexres(FILE *f)
+{
+    unsigned long total = 0, ws[10] = { 0 };
+    Client *c;
+    int i;
+
+    for (c = clients; c; c = c->next)
+        if (c->workspace >= 0 && c->workspace < 10)
+            ws[c->workspace] += c->xresbytes;
+    for (i = 0; i < nxresusage; i++)
+        total += xresusage[i].bytes;
+
+    fprintf(f, "\n[resources]\n");
+    fprintf(f, "%lu samples, last took %.1fms, %d X clients with %lu KiB of pixmaps\n",
+            xressamples, xresms, nxresusage, total >> 10);
+    for (i = 0; i < 10; i++)
+        if (ws[i])
+            fprintf(f, "workspace %d: %lu KiB\n", i, ws[i] >> 10);
+    fprintf(f, "%-10s %7s %10s %10s %7s %7s %3s %s\n", "window", "pid", "pixmap_kb",
+            "growth_kb", "windows", "pixmaps", "ws", "class");
+    for (i = 0; i < nxresusage; i++) {
+        XResUsage *u = &xresusage[i];
+        c = u->win ? wintoclient(u->win) : NULL;
+        fprintf(f, "0x%-8lx %7d %10lu %10ld %7u %7u %3d %s\n", u->win, (int)u->pid,
+                u->bytes >> 10, ((long)u->bytes - (long)u->prevbytes) / 1024,
+                u->windows, u->pixmaps, c ? c->workspace : -1, c ? c->class : "-");
+    }
+}
+#endif
+
+#ifdef XDAMAGE
+/* Redraw-rate monitor
+ * With DAMAGE_MONITOR, every managed window gets a Damage object reporting
+ * its bounding box; each report is subtracted right away so one event is
+ * one repaint. A 1s timer folds the counts into averaged rates and notes
+ * windows that repaint while nobody can see them: covered by a fullscreen
+ * or floating window, or while the user is idle. Unmapped windows have no
+ * contents to damage, so windows on hidden workspaces never report at all.
+ * Repaints that are not covered cost DAMAGE_VISIBLE_WEIGHT times more
+ * since they reach the screen. */
+enum { DmgIdle, DmgOccluded };
+static const char *dmgreasons[] = { "idle", "occluded" };
+static int damagetimer = -1;       /* 1s timerfd */
+
+static void
+setupdamage(void)
+{
+    struct itimerspec its = { { 1, 0 }, { 1, 0 } };
+    int errbase;
+
+    if (!DAMAGE_MONITOR || replaying)
+        return;
+    if (!XDamageQueryExtension(dpy, &damageevbase, &errbase)) {
+        wm_log("Damage extension not available, no redraw monitor\n");
+        return;
+    }
+    damagetimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (damagetimer < 0 || timerfd_settime(damagetimer, 0, &its, NULL) < 0) {
+        wm_log("Cannot start the redraw monitor timer: %s\n", strerror(errno));
+        if (damagetimer >= 0)
+            close(damagetimer);
+        damagetimer = -1;
+        return;
+    }
+    damagemon = 1;
+}
+
+static void
+damagenotify(XEvent *e)
+{
+    XDamageNotifyEvent *ev = (XDamageNotifyEvent *)e;
+    Client *c;
+
+    /* Empty the region so the next repaint reports again */
+    if (!ev->more)
+        XDamageSubtract(dpy, ev->damage, None, None);
+    if (!(c = wintoclient(ev->drawable)))
+        return;
+    c->dmgevents++;
+    c->dmgpixels += (unsigned long)ev->area.width * ev->area.height;
+}
+
+/* Covered by a fullscreen window or a floating window above it */
+static int
+occluded(Client *c)
+{
+    Client *o;
+
+    for (o = clients; o; o = o->next) {
+        if (o == c || o->mon != c->mon || !ISVISIBLE(o))
+            continue;
+        if (o->isfullscreen && !c->isfullscreen)
+            return 1;
+        if (o->isfloating && (!c->isfloating || o->raised > c->raised) &&
+            o->x <= c->x && o->y <= c->y &&
+            o->x + o->w >= c->x + c->w && o->y + o->h >= c->y + c->h)
+            return 1;
+    }
+    return 0;
+}
+
+/* User idle according to the screen saver extension, never without it */
+static int
+useridle(void)
+{
+#ifdef XSS
+    static XScreenSaverInfo *info = NULL;
+    int evbase, errbase;
+
+    if (!info && XScreenSaverQueryExtension(dpy, &evbase, &errbase))
+        info = XScreenSaverAllocInfo();
+    if (info && XScreenSaverQueryInfo(dpy, root, info))
+        return info->idle >= DAMAGE_IDLE_S * 1000ul;
+#endif
+    return 0;
+}
+
+static void
+damagetick(void)
+{
+    uint64_t expirations;
+    Client *c;
+    int idle, covered, why;
+
+    if (read(damagetimer, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+    idle = useridle();
+    for (c = clients; c; c = c->next) {
+        if (!c->damage)
+            continue;
+        /* Averaged over roughly the last ten seconds */
+        covered = c->dmgevents && occluded(c);
+        c->dmgrate += (c->dmgevents - c->dmgrate) * 0.1;
+        c->dmgpxrate += (c->dmgpixels - c->dmgpxrate) * 0.1;
+        c->dmgcost += (c->dmgpixels * (covered ? 1 : DAMAGE_VISIBLE_WEIGHT)
+                       - c->dmgcost) * 0.1;
+
+        why = -1;
+        if (c->dmgevents)
+            why = covered ? DmgOccluded : idle ? DmgIdle : -1;
+        if (why < 0) {
+            c->dmgstreak = 0;
+        } else {
+            c->dmgunseen[why]++;
+            if (++c->dmgstreak == DAMAGE_FLAG_S)
+                wm_log("Window 0x%lx (%s, pid %d) keeps repainting while %s, %.1f/s\n",
+                       c->win, c->class, (int)c->pid, dmgreasons[why], c->dmgrate);
+        }
+        c->dmgevents = 0;
+        c->dmgpixels = 0;
+    }
+}
+
+static int
+dmgcmp(const void *a, const void *b)
+{
+    const Client *ca = *(Client *const *)a, *cb = *(Client *const *)b;
+    return ca->dmgcost < cb->dmgcost ? 1 : ca->dmgcost > cb->dmgcost ? -1 : 0;
+}
+
+static void
+writedamage(FILE *f)
+{
+    Client *c, **v;
+    int i, n = 0;
+
+    for (c = clients; c; c = c->next)
+        n++;
+    if (!(v = calloc(n ? n : 1, sizeof(Client *))))
         return;
+    for (n = 0, c = clients; c; c = c->next)
+        v[n++] = c;
+    qsort(v, n, sizeof(Client *), dmgcmp);
+
+    fprintf(f, "\n[damage]\n");
+    fprintf(f, "%-10s %7s %3s %8s %9s %9s %6s %8s %-20s\n", "window", "pid", "ws",
+            "redraw/s", "kpx/s", "cost", "idle_s", "occlud_s", "class");
+    for (i = 0; i < n; i++) {
+        c = v[i];
+        fprintf(f, "0x%-8lx %7d %3d %8.1f %9.1f %9.1f %6u %8u %-20s\n", c->win,
+                (int)c->pid, c->workspace, c->dmgrate, c->dmgpxrate / 1000,
+                c->dmgcost / 1000, c->dmgunseen[DmgIdle], c->dmgunseen[DmgOccluded],
+                c->class);
     }
+    free(v);
+}
+#endif
 
-    /* Rest of tiling logic */
-    if (n == 0)
-        return;
+/* Write the statistics report, on SIGUSR1 and at exit */
+static void
+writestats(void)
+{
+    FILE *f = fopen(statspath, "w");
+    int i;
 
-    /* If only one non-floating window, make it fullscreen */
-    if (n == 1) {
-        for (c = clients; c; c = c->next) {
-            if (!c->isfloating) {
-                XMoveResizeWindow(dpy, c->win, 0, 0, attr.width, attr.height);
-                break;
-            }
-        }
+    if (!f) {
+        wm_log("Cannot write stats to %s: %s\n", statspath, strerror(errno));
         return;
     }
 
-    /* Find the first non-floating window as master */
-    for (c = clients; c; c = c->next) {
-        if (!c->isfloating) {
-            master = c;
-            break;
+    fprintf(f, "[commands]\n");
+    fprintf(f, "%-40s %8s %7s %6s %9s %9s %6s %9s %9s\n", "command", "launches",
+            "running", "failed", "avg_ms", "max_ms", "maps", "map_ms", "map_max");
+    for (i = 0; i < ncmdstats; i++) {
+        CmdStat *cs = &cmdstats[i];
+        unsigned int done = cs->launches - cs->running;
+        fprintf(f, "%-40.40s %8u %7u %6u %9.1f %9.1f %6u %9.1f %9.1f\n", cs->cmd,
+                cs->launches, cs->running, cs->failed,
+                done ? cs->total_ms / done : 0.0, cs->max_ms, cs->maps,
+                cs->maps ? cs->map_ms / cs->maps : 0.0, cs->map_max_ms);
+    }
+    fprintf(f, "unknown children reaped: %u\n", unknownreaped);
+
+    double mins = elapsed_ms(&starttime) / 60000;
+    fprintf(f, "\n[masks]\n");
+    fprintf(f, "%-22s %9s %9s\n", "source", "events", "per_min");
+    for (i = 0; i < MaskLast; i++)
+        fprintf(f, "%-22s %9lu %9.2f\n", masknames[i], maskevents[i],
+                mins > 0 ? maskevents[i] / mins : 0.0);
+    fprintf(f, "unbound key events: %lu\n", unboundkeys);
+    fprintf(f, "key repeats ignored: %lu, coalesced: %lu\n", repeatsignored, repeatscoalesced);
+#ifdef XFIXES
+    fprintf(f, "\n[clipboard]\n");
+    for (i = 0; i < 2; i++)
+        fprintf(f, "%-9s cached %lu bytes%s\n", clips[i].sel == clipboard ? "CLIPBOARD" : "PRIMARY",
+                clips[i].data ? clips[i].data->len : 0, clips[i].owned ? ", owned" : "");
+    fprintf(f, "fetched %lu, pastes served %lu (%lu with INCR)\n",
+            clipfetched, clipserved, clipincr);
+#endif
+    fprintf(f, "server wakeups: %lu\n", wakeups);
+    fprintf(f, "bar segment redraws: %lu\n", barredraws);
+
+    fprintf(f, "\n[queue]\n");
+    fprintf(f, "batches by depth: 1 %lu, 2-7 %lu, 8-31 %lu, 32-127 %lu, 128+ %lu, max %d\n",
+            qdepth[0], qdepth[1], qdepth[2], qdepth[3], qdepth[4], qdepthmax);
+    fprintf(f, "input events: %lu, wait avg %.3fms max %.3fms\n", inputevents,
+            inputevents ? inputwait_ns / 1e6 / inputevents : 0.0, inputwaitmax_ns / 1e6);
+    fprintf(f, "input run early: %lu, ahead of %lu queued events\n", inputearly, inputovertook);
+    for (i = 0; i < LASTEvent; i++)
+        if (coalesced[i])
+            fprintf(f, "coalesced %-18s %9lu\n", eventname(i), coalesced[i]);
+#ifdef XRES
+    if (xres)
+        writexres(f);
+#endif
+#ifdef XDAMAGE
+    if (damagemon)
+        writedamage(f);
+#endif
+
+    fprintf(f, "\n[stalls]\n");
+    long minute = time(NULL) / 60;
+    for (unsigned int j = 0; j < NSTALL; j++) {
+        unsigned int hour = 0;
+        for (i = 0; i < 60; i++)
+            if (stallring[i].minute > minute - 60)
+                hour += stallring[i].n[j];
+        fprintf(f, "over %4.0fms: %lu total, %u in the last hour\n", stallms[j], stalls[j], hour);
+    }
+
+    fprintf(f, "\n[handlers]\n");
+    fprintf(f, "%-18s %9s %9s %9s %9s\n", "event", "events", "avg_us", "max_us", "req/event");
+    for (i = 0; i <= LASTEvent; i++) {
+        HandlerStat *hs = &hstats[i];
+        if (hs->events)
+            fprintf(f, "%-18s %9lu %9.1f %9.1f %9.2f\n", eventname(i), hs->events,
+                    hs->total_ms * 1e3 / hs->events, hs->max_ms * 1e3,
+                    (double)hs->requests / hs->events);
+    }
+    if (tracefp)
+        fflush(tracefp);
+
+    fclose(f);
+    wm_log("Wrote stats to %s\n", statspath);
+}
+
+static void
+readsignals(void)
+{
+    struct signalfd_siginfo si;
+
+    while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGCHLD)
+            reap();
+        else if (si.ssi_signo == SIGUSR1) {
+#ifdef XRES
+            xressample();
+#endif
+            writestats();
         }
     }
+}
+
+/* Workspace cgroups
+ * The window manager moves itself into a "wm" leaf of its own (delegated)
+ * cgroup v2 and creates ws1-ws9 next to it. Spawned commands start in the
+ * cgroup of the current workspace and follow their window through
+ * _NET_WM_PID; workspaces shown on a monitor get the higher CPU and IO
+ * weight. */
+#define CG_CPU 1
+#define CG_IO  2
+
+static char cgroupdir[PATH_MAX];   /* Our own cgroup, empty when disabled */
+static int cgroupctl = 0;          /* Controllers enabled for the workspaces */
+static int cgweight[10];           /* Weight last written per workspace */
+
+/* Plain write(2), also used between fork and exec */
+static int
+cgwrite(const char *dir, const char *file, const char *val)
+{
+    char path[PATH_MAX + 32];
+    int fd, ok;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+        return -1;
+    ok = write(fd, val, strlen(val)) == (ssize_t)strlen(val);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+static void
+setupcgroups(void)
+{
+    char line[1024], dir[PATH_MAX + 8], pid[16];
+    FILE *f;
 
-    /* Master */
-    if (master) {
-        int master_width = (attr.width * mfact) - (GAP_WIDTH * 1.5) - (BORDER_WIDTH * 2);
-        XMoveResizeWindow(dpy, master->win,
-                        GAP_WIDTH,                    // x position
-                        GAP_WIDTH,                    // y position
-                        master_width,                 // width
-                        attr.height - (GAP_WIDTH * 2) - (BORDER_WIDTH * 2)); // height
-        XRaiseWindow(dpy, master->win);
+    /* WM_NO_CGROUPS keeps test and training instances in their cgroup */
+    if (!CGROUP_WORKSPACES || replaying || getenv("WM_NO_CGROUPS"))
+        return;
+    if (!(f = fopen("/proc/self/cgroup", "r")))
+        return;
+    while (fgets(line, sizeof(line), f))
+        if (!strncmp(line, "0::", 3)) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(cgroupdir, sizeof(cgroupdir), "/sys/fs/cgroup%s", line + 3);
+        }
+    fclose(f);
+    if (!*cgroupdir)
+        return;
+
+    /* After a reload we already live in the wm leaf next to ws1-9 */
+    size_t len = strlen(cgroupdir);
+    if (len > 3 && !strcmp(cgroupdir + len - 3, "/wm")) {
+        cgroupdir[len - 3] = '\0';
+        snprintf(dir, sizeof(dir), "%s/ws1", cgroupdir);
+        if (access(dir, F_OK) < 0)
+            cgroupdir[len - 3] = '/';
     }
 
-    /* Stack */
-    if (n > 1) {
-        int stack_width = (attr.width * (1 - mfact)) - (GAP_WIDTH * 1.5) - (BORDER_WIDTH * 2);
-        int x = (attr.width * mfact) + (GAP_WIDTH * 0.5);
-        int i = 0;
-        for (c = clients; c; c = c->next) {
-            if (!c->isfloating && c != master) {
-                int height = (attr.height / (n - 1)) - (GAP_WIDTH * 2) - (BORDER_WIDTH * 2);
-                XMoveResizeWindow(dpy, c->win,
-                                x,                                         // x position
-                                (i * (height + GAP_WIDTH)) + GAP_WIDTH,   // y position with gap
-                                stack_width,                              // width
-                                height);                                  // height
-                XRaiseWindow(dpy, c->win);
-                i++;
-            }
+    /* Processes may only live in leaves once controllers are enabled */
+    snprintf(dir, sizeof(dir), "%s/wm", cgroupdir);
+    snprintf(pid, sizeof(pid), "%d", getpid());
+    if ((mkdir(dir, 0755) < 0 && errno != EEXIST) || cgwrite(dir, "cgroup.procs", pid) < 0) {
+        wm_log("Cgroup %s is not delegated to us, workspace cgroups disabled\n", cgroupdir);
+        *cgroupdir = '\0';
+        return;
+    }
+    if (!cgwrite(cgroupdir, "cgroup.subtree_control", "+cpu"))
+        cgroupctl |= CG_CPU;
+    if (!cgwrite(cgroupdir, "cgroup.subtree_control", "+io"))
+        cgroupctl |= CG_IO;
+
+    for (int i = 1; i <= 9; i++) {
+        snprintf(dir, sizeof(dir), "%s/ws%d", cgroupdir, i);
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            wm_log("Cannot create %s: %s\n", dir, strerror(errno));
+            *cgroupdir = '\0';
+            return;
         }
+        cgweight[i] = -1;
     }
+    wm_log("Workspace cgroups under %s (cpu %s, io %s)\n", cgroupdir,
+           cgroupctl & CG_CPU ? "on" : "off", cgroupctl & CG_IO ? "on" : "off");
 }
 
-void
-focusnext(const char **arg __attribute__((unused)))
+/* Move a process into the cgroup of a workspace, pid 0 is the caller */
+static int
+cgroupplace(pid_t pid, int workspace)
+{
+    char dir[PATH_MAX + 8], val[16];
+
+    if (!*cgroupdir || workspace < 1 || workspace > 9)
+        return -1;
+    snprintf(dir, sizeof(dir), "%s/ws%d", cgroupdir, workspace);
+    snprintf(val, sizeof(val), "%d", pid);
+    return cgwrite(dir, "cgroup.procs", val);
+}
+
+/* Let the process of a client follow it to another workspace. Only
+ * processes already in a workspace cgroup are moved, the rest belong to
+ * whoever started them. */
+static void
+cgroupmove(Client *c)
 {
-    if (!sel || !sel->next)
+    char path[64], line[PATH_MAX], prefix[PATH_MAX + 8];
+    const char *rel = cgroupdir + strlen("/sys/fs/cgroup");
+    FILE *f;
+    int move = 0;
+
+    if (!*cgroupdir || c->pid <= 1)
+        return;
+    snprintf(path, sizeof(path), "/proc/%d/cgroup", c->pid);
+    if (!(f = fopen(path, "r")))
         return;
-    focus(sel->next);
+    snprintf(prefix, sizeof(prefix), "0::%s/ws", rel);
+    while (fgets(line, sizeof(line), f))
+        if (!strncmp(line, prefix, strlen(prefix)))
+            move = atoi(line + strlen(prefix)) != c->workspace;
+    fclose(f);
+    if (move && cgroupplace(c->pid, c->workspace) < 0)
+        wm_log("Cannot move process %d to workspace %d: %s\n", c->pid,
+               c->workspace, strerror(errno));
 }
 
-void
-focusprev(const char **arg __attribute__((unused)))
+/* Boost the workspaces shown on a monitor, writing only what changed */
+static void
+updateweights(void)
 {
-    Client *c;
-    if (!sel || !clients)
+    char dir[PATH_MAX + 8], val[32];
+    Monitor *m;
+
+    if (!*cgroupdir || !cgroupctl)
         return;
-    for (c = clients; c->next && c->next != sel; c = c->next);
-    focus(c);
+    for (int i = 1; i <= 9; i++) {
+        int w = CGROUP_IDLE_WEIGHT;
+        for (m = mons; m; m = m->next)
+            if (m->workspace == i)
+                w = CGROUP_ACTIVE_WEIGHT;
+        if (w == cgweight[i])
+            continue;
+        snprintf(dir, sizeof(dir), "%s/ws%d", cgroupdir, i);
+        snprintf(val, sizeof(val), "%d", w);
+        if (cgroupctl & CG_CPU)
+            cgwrite(dir, "cpu.weight", val);
+        snprintf(val, sizeof(val), "default %d", w);
+        if (cgroupctl & CG_IO)
+            cgwrite(dir, "io.weight", val);
+        cgweight[i] = w;
+    }
 }
 
-void
-spawn(const char **arg)
+/* Launch a command into the cgroup of a workspace, returns its pid or -1 */
+static pid_t
+spawnon(const char **arg, int workspace)
 {
     if (!validate_spawn_args(arg))
-        return;
+        return -1;
+    if (replaying) {
+        wm_log("Replay: not spawning %s\n", arg[0]);
+        return -1;
+    }
+
+    /* Everything the child needs is prepared here: the watchdog thread may
+     * hold a stdio or malloc lock at fork time, so the child only makes
+     * async-signal-safe calls */
+    const char *home = getenv("HOME") ? getenv("HOME") : "";
+    char pathenv[1024], homeenv[512], exe[PATH_MAX], script[PATH_MAX], cgprocs[PATH_MAX + 32];
+    char failmsg[PATH_MAX + 32];
+    const char *sh_args[] = { "/bin/sh", script, NULL };
+    const char *const *argv = arg;
+    size_t nenv = 0, i, j;
+    int closefd[2], logfd = logfile ? fileno(logfile) : STDERR_FILENO;
+
+    snprintf(pathenv, sizeof(pathenv), "PATH=/usr/local/bin:/usr/bin:/bin:%s/.local/bin", home);
+    snprintf(homeenv, sizeof(homeenv), "HOME=%s", home);
+    for (; environ[nenv]; nenv++);
+    char **envp = malloc((nenv + 3) * sizeof(char *));
+    if (!envp) {
+        wm_log("Failed to allocate the environment for %s\n", arg[0]);
+        return -1;
+    }
+    for (i = j = 0; i < nenv; i++)
+        if (strncmp(environ[i], "PATH=", 5) && strncmp(environ[i], "HOME=", 5))
+            envp[j++] = environ[i];
+    envp[j++] = pathenv;
+    envp[j++] = homeenv;
+    envp[j] = NULL;
+
+    /* Shell scripts run through sh with ~ expanded, the rest from the clean PATH */
+    if (strstr(arg[0], ".sh")) {
+        if (arg[0][0] == '~')
+            snprintf(script, sizeof(script), "%s%s", home, arg[0] + 1);
+        else
+            snprintf(script, sizeof(script), "%s", arg[0]);
+        snprintf(exe, sizeof(exe), "/bin/sh");
+        argv = sh_args;
+    } else if (strchr(arg[0], '/')) {
+        snprintf(exe, sizeof(exe), "%s", arg[0]);
+    } else {
+        char dirs[sizeof(pathenv)], *dir, *save;
+        snprintf(dirs, sizeof(dirs), "%s", pathenv + 5);
+        snprintf(exe, sizeof(exe), "%s", arg[0]);
+        for (dir = strtok_r(dirs, ":", &save); dir; dir = strtok_r(NULL, ":", &save)) {
+            snprintf(exe, sizeof(exe), "%s/%s", dir, arg[0]);
+            if (access(exe, X_OK) == 0)
+                break;
+        }
+    }
+
+    /* Start out in the cgroup of the workspace it was launched for */
+    *cgprocs = '\0';
+    if (*cgroupdir && workspace >= 1 && workspace <= 9)
+        snprintf(cgprocs, sizeof(cgprocs), "%s/ws%d/cgroup.procs", cgroupdir, workspace);
+    snprintf(failmsg, sizeof(failmsg), "Failed to execute: %s\n", arg[0]);
+    closefd[0] = dpy ? ConnectionNumber(dpy) : -1;
+    closefd[1] = sigfd;
 
     /* Fork and execute command */
+    PROBE1(spawn_entry, arg[0]);
     pid_t pid = fork();
     if (pid == 0) {
-        if (dpy)
-            close(ConnectionNumber(dpy));
-
-        /* Set clean environment variables */
-        const char *home = getenv("HOME");
-        char path[1024];
-        snprintf(path, sizeof(path), "PATH=/usr/local/bin:/usr/bin:/bin:%s/.local/bin", home);
-        char home_env[512];
-        snprintf(home_env, sizeof(home_env), "HOME=%s", home);
-        putenv(path);
-        putenv(home_env);
+        for (i = 0; i < 2; i++)
+            if (closefd[i] >= 0)
+                close(closefd[i]);
+        if (*cgprocs) {
+            int fd = open(cgprocs, O_WRONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                if (write(fd, "0", 1) < 0) {
+                    /* Stays in our cgroup */
+                }
+                close(fd);
+            }
+        }
 
+        /* Undo the signal blocking used for the signalfd */
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
         setsid();
 
-        /* For shell scripts, expand path and use sh directly */
-        if (strstr(arg[0], ".sh")) {
-            char expanded_path[PATH_MAX];
-            if (arg[0][0] == '~') {
-                snprintf(expanded_path, sizeof(expanded_path), "%s%s", home, arg[0] + 1);
-            } else {
-                strncpy(expanded_path, arg[0], sizeof(expanded_path) - 1);
-            }
-            
-            const char *sh_args[] = {"/bin/sh", expanded_path, NULL};
-            execv("/bin/sh", (char *const*)sh_args);
-        } else {
-            execvp(arg[0], (char *const*)arg);
+        execve(exe, (char *const *)argv, envp);
+        if (write(logfd, failmsg, strlen(failmsg)) < 0) {
+            /* Nowhere left to report it */
         }
-        
-        wm_log("Failed to execute: %s\n", arg[0]);
-        exit(1);
+        _exit(1);
     } else if (pid < 0) {
         wm_log("Fork failed for spawn command: %s\n", arg[0]);
+    } else {
+        procstart(pid, arg);
     }
+    free(envp);
+    PROBE2(spawn_return, arg[0], pid);
+    return pid;
+}
+
+void
+spawn(const char **arg)
+{
+    spawnon(arg, selmon ? selmon->workspace : 0);
 }
 
 void
@@ -595,11 +3652,15 @@ setmfact(const char **arg)
     float f;
     if (!arg || !arg[0])
         return;
-    f = mfact + atof(arg[0]);
-    if (f < 0.1 || f > 0.9)
+    f = selmon->mfact + atof(arg[0]) * keysteps;
+    if (f < 0.1)
+        f = 0.1;
+    if (f > 0.9)
+        f = 0.9;
+    if (f == selmon->mfact)
         return;
-    mfact = f;
-    arrange();
+    selmon->mfact = f;
+    arrange(selmon);
 }
 
 void
@@ -616,7 +3677,7 @@ togglefloating(const char **arg __attribute__((unused)))
         sel->h = wa.height;
     }
     sel->isfloating = !sel->isfloating;
-    arrange();
+    arrange(sel->mon);
 }
 
 void
@@ -638,7 +3699,8 @@ togglefullscreen(const char **arg __attribute__((unused)))
 
         /* Remove borders and go full screen */
         XSetWindowBorderWidth(dpy, sel->win, 0);
-        XMoveResizeWindow(dpy, sel->win, 0, 0, attr.width, attr.height);
+        XMoveResizeWindow(dpy, sel->win, sel->mon->mx, sel->mon->my,
+                          sel->mon->mw, sel->mon->mh);
         XRaiseWindow(dpy, sel->win);
     } else {
         /* Restore borders and previous size */
@@ -646,8 +3708,9 @@ togglefullscreen(const char **arg __attribute__((unused)))
         XSetWindowBorder(dpy, sel->win, ACTIVE_BORDER);
         XMoveResizeWindow(dpy, sel->win, sel->x, sel->y, sel->w, sel->h);
     }
+    setwinstate(sel, 1);
 
-    arrange();
+    arrange(sel->mon);
 }
 
 void
@@ -662,12 +3725,18 @@ void
 cleanup(void) {
     Client *c, *tmp;
 
+    thawall();
+
     // Clean up all managed windows
     c = clients;
     while (c) {
         tmp = c->next;
         if (!running) // Only unmap windows if we're actually quitting
             XUnmapWindow(dpy, c->win);
+#ifdef XDAMAGE
+        if (c->damage)
+            XDamageDestroy(dpy, c->damage);
+#endif
         free(c);
         c = tmp;
     }
@@ -678,6 +3747,7 @@ cleanup(void) {
 
 void
 quit(const char **arg __attribute__((unused))) {
+    sessionsave();
     cleanup();
     running = 0;
 }
@@ -700,7 +3770,7 @@ swapmaster(const char **arg __attribute__((unused)))
     else if (sel == clients)
         sel = c;
 
-    arrange();
+    arrange(selmon);
 }
 
 void
@@ -723,35 +3793,699 @@ enternotify(XEvent *e)
     }
 }
 
-void
-scan(void)
+/* Saved state of the previous instance, indexed by window */
+typedef struct {
+    Window *wins;
+    long *workspaces, *states, *monitors;
+    unsigned long n;
+    int *slot;                  /* Open addressing table of indices */
+    unsigned long mask;
+} SavedState;
+
+static long *
+getlongs(xcb_get_property_cookie_t ck, unsigned long *n)
+{
+    xcb_get_property_reply_t *rep = xcb_get_property_reply(xc, ck, NULL);
+    long *v = NULL;
+
+    *n = 0;
+    if (!rep)
+        return NULL;
+    if (rep->format == 32 && (*n = xcb_get_property_value_length(rep) / 4)) {
+        const uint32_t *d = xcb_get_property_value(rep);
+        if ((v = malloc(*n * sizeof(long))))
+            for (unsigned long i = 0; i < *n; i++)
+                v[i] = d[i];
+        else
+            *n = 0;
+    }
+    free(rep);
+    return v;
+}
+
+static int
+savedindex(SavedState *ss, Window w)
+{
+    if (!ss->slot)
+        return -1;
+    for (unsigned long h = (w * 2654435761u) & ss->mask; ss->slot[h] >= 0; h = (h + 1) & ss->mask)
+        if (ss->wins[ss->slot[h]] == w)
+            return ss->slot[h];
+    return -1;
+}
+
+/* Take over the windows of a running session.
+ * Attributes, geometry, WM_STATE and the properties the rules need are
+ * requested for every root child in one pipelined batch, together with the
+ * state saved by the previous instance on reload. Override-redirect and
+ * withdrawn windows are left alone, and one arrange runs at the end. */
+void
+scan(void)
+{
+    struct timespec t0, t1;
+    xcb_query_tree_reply_t *tree;
+    xcb_get_property_cookie_t saved[5];
+    SavedState ss = { 0 };
+    unsigned long n, i, nmonws = 0;
+    long *monws;
+    int managed = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (!(tree = xcb_query_tree_reply(xc, xcb_query_tree(xc, root), NULL)))
+        return;
+    n = xcb_query_tree_children_length(tree);
+    xcb_window_t *children = xcb_query_tree_children(tree);
+
+    xcb_get_window_attributes_cookie_t *ac = malloc(n * sizeof(*ac));
+    xcb_get_geometry_cookie_t *gc = malloc(n * sizeof(*gc));
+    xcb_get_property_cookie_t *sc = malloc(n * sizeof(*sc));
+    PropRequest *pr = malloc(n * sizeof(*pr));
+    Client **adopted = NULL;
+    if (n && (!ac || !gc || !sc || !pr)) {
+        wm_log("Fatal: failed to allocate memory for client during scan\n");
+        goto out;
+    }
+
+    /* Queue everything before waiting for the first reply; the saved
+     * properties are deleted as they are read */
+    saved[0] = xcb_get_property(xc, 1, root, atom[WMWindows], XA_WINDOW, 0, 1024);
+    saved[1] = xcb_get_property(xc, 1, root, atom[WMWorkspaces], XA_CARDINAL, 0, 1024);
+    saved[2] = xcb_get_property(xc, 1, root, atom[WMWindowStates], XA_CARDINAL, 0, 1024);
+    saved[3] = xcb_get_property(xc, 1, root, atom[WMMonitors], XA_CARDINAL, 0, 1024);
+    saved[4] = xcb_get_property(xc, 1, root, atom[WMMonitorWorkspaces], XA_CARDINAL, 0, 64);
+    for (i = 0; i < n; i++) {
+        ac[i] = xcb_get_window_attributes(xc, children[i]);
+        gc[i] = xcb_get_geometry(xc, children[i]);
+        sc[i] = xcb_get_property(xc, 0, children[i], atom[WMStateProp], atom[WMStateProp], 0, 2);
+        propsend(children[i], &pr[i]);
+    }
+    xcb_flush(xc);
+
+    ss.wins = (Window *)getlongs(saved[0], &ss.n);
+    ss.workspaces = getlongs(saved[1], &i);
+    if (i < ss.n) { free(ss.workspaces); ss.workspaces = NULL; }
+    ss.states = getlongs(saved[2], &i);
+    if (i < ss.n) { free(ss.states); ss.states = NULL; }
+    ss.monitors = getlongs(saved[3], &i);
+    if (i < ss.n) { free(ss.monitors); ss.monitors = NULL; }
+    monws = getlongs(saved[4], &nmonws);
+
+    if (ss.n && ss.workspaces) {
+        for (ss.mask = 1; ss.mask < ss.n * 2; ss.mask <<= 1);
+        ss.slot = malloc(ss.mask * sizeof(int));
+        adopted = calloc(ss.n, sizeof(Client *));
+        if (ss.slot && adopted) {
+            memset(ss.slot, -1, ss.mask * sizeof(int));
+            ss.mask--;
+            for (i = 0; i < ss.n; i++) {
+                unsigned long h = (ss.wins[i] * 2654435761u) & ss.mask;
+                while (ss.slot[h] >= 0)
+                    h = (h + 1) & ss.mask;
+                ss.slot[h] = i;
+            }
+        } else {
+            free(ss.slot);
+            ss.slot = NULL;
+        }
+    }
+
+    /* Restore what each monitor was showing */
+    for (Monitor *m = mons; m; m = m->next)
+        if ((unsigned long)m->num < nmonws && monws[m->num] >= 1 && monws[m->num] <= 9)
+            m->workspace = monws[m->num];
+
+    for (i = 0; i < n; i++) {
+        xcb_get_window_attributes_reply_t *wa = xcb_get_window_attributes_reply(xc, ac[i], NULL);
+        xcb_get_geometry_reply_t *geom = xcb_get_geometry_reply(xc, gc[i], NULL);
+        xcb_get_property_reply_t *st = xcb_get_property_reply(xc, sc[i], NULL);
+        int iconic = st && xcb_get_property_value_length(st) >= 4 &&
+                     *(uint32_t *)xcb_get_property_value(st) == IconicState;
+        int idx = savedindex(&ss, children[i]);
+        Client *c = NULL;
+
+        /* Helpers are skipped unless the previous instance managed them */
+        if (!wa || !geom || children[i] == root || wintoclient(children[i]) ||
+            (idx < 0 && (wa->override_redirect ||
+                         (wa->map_state != XCB_MAP_STATE_VIEWABLE && !iconic))) ||
+            !(c = newclient(children[i], geom->x, geom->y, geom->width, geom->height))) {
+            propdiscard(&pr[i]);
+        } else {
+            propreceive(c, &pr[i]);
+            if (idx >= 0) {
+                /* Only the policies of the rules apply, placement is restored */
+                int x = c->x, y = c->y, w = c->w, h = c->h;
+                applyrules(c);
+                c->x = x;
+                c->y = y;
+                c->w = w;
+                c->h = h;
+                for (Monitor *m = mons; m; m = m->next)
+                    if (ss.monitors && m->num == ss.monitors[idx])
+                        c->mon = m;
+                c->workspace = ss.workspaces[idx] >= 1 && ss.workspaces[idx] <= 9 ?
+                               ss.workspaces[idx] : c->mon->workspace;
+                /* A hidden scratchpad stays hidden */
+                if (claimscratch(c) && ss.workspaces[idx] == 0)
+                    c->workspace = 0;
+                c->isfloating = ss.states ? ss.states[idx] : 0;
+                if (adopted[idx])
+                    free(adopted[idx]);
+                adopted[idx] = c;
+            } else {
+                applyrules(c);
+                applytransient(c);
+                if (c->isfloating && !c->placed)
+                    placefloating(c);
+                if (manage(c))
+                    managed++;
+            }
+        }
+        free(wa);
+        free(geom);
+        free(st);
+    }
+
+    /* Adopted windows keep the order they had in the previous instance */
+    for (i = ss.n; adopted && i-- > 0;)
+        if (adopted[i] && manage(adopted[i]))
+            managed++;
+    /* Adopted dialogs keep their place but stay above their parent again */
+    for (Client *c = clients, *p; c; c = c->next)
+        if (c->transientfor != None && !c->parent && (p = wintoclient(c->transientfor)))
+            attachtransient(c, p);
+
+    arrange(NULL);
+    for (Client *c = clients; c; c = c->next)
+        setvisible(c, ISVISIBLE(c));
+    for (Client *c = clients; c; c = c->next)
+        if (c->mon == selmon && ISVISIBLE(c)) {
+            focus(c);
+            break;
+        }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    wm_log("Adopted %d of %lu windows (%lu saved) in %.2fms\n", managed, n, ss.n,
+           (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+    free(adopted);
+    free(ss.slot);
+    free(ss.wins);
+    free(ss.workspaces);
+    free(ss.states);
+    free(ss.monitors);
+    free(monws);
+out:
+    free(ac);
+    free(gc);
+    free(sc);
+    free(pr);
+    free(tree);
+}
+
+/* Save the client list on the root window for the next instance to adopt */
+static void
+savestate(void)
+{
+    unsigned long n = 0, i = 0, nmons = 0;
+    Client *c;
+    Monitor *m;
+
+    for (c = clients; c; c = c->next)
+        n++;
+    for (m = mons; m; m = m->next)
+        nmons++;
+
+    long *wins = malloc((n ? n : 1) * sizeof(long));
+    long *workspaces = malloc((n ? n : 1) * sizeof(long));
+    long *states = malloc((n ? n : 1) * sizeof(long));
+    long *monitors = malloc((n ? n : 1) * sizeof(long));
+    long *monws = malloc(nmons * sizeof(long));
+    if (!wins || !workspaces || !states || !monitors || !monws) {
+        wm_log("Failed to allocate memory to save state\n");
+        goto out;
+    }
+
+    for (c = clients; c; c = c->next, i++) {
+        wins[i] = c->win;
+        workspaces[i] = c->workspace;
+        states[i] = c->isfloating;
+        monitors[i] = c->mon->num;
+    }
+    for (m = mons, i = 0; m; m = m->next, i++)
+        monws[i] = m->workspace;
+
+    XChangeProperty(dpy, root, atom[WMWindows], XA_WINDOW, 32, PropModeReplace,
+                    (unsigned char *)wins, n);
+    XChangeProperty(dpy, root, atom[WMWorkspaces], XA_CARDINAL, 32, PropModeReplace,
+                    (unsigned char *)workspaces, n);
+    XChangeProperty(dpy, root, atom[WMWindowStates], XA_CARDINAL, 32, PropModeReplace,
+                    (unsigned char *)states, n);
+    XChangeProperty(dpy, root, atom[WMMonitors], XA_CARDINAL, 32, PropModeReplace,
+                    (unsigned char *)monitors, n);
+    XChangeProperty(dpy, root, atom[WMMonitorWorkspaces], XA_CARDINAL, 32, PropModeReplace,
+                    (unsigned char *)monws, nmons);
+    XSync(dpy, False);
+out:
+    free(wins);
+    free(workspaces);
+    free(states);
+    free(monitors);
+    free(monws);
+}
+
+/* Session
+ * The command line, workspace, output, floating state and list position of
+ * every window are saved a few seconds after a change and on quit. Starting
+ * with no windows to adopt relaunches the saved commands at once; their
+ * windows are matched to saved slots as they map and held unmapped on their
+ * workspace until all are back, then each output is laid out once. */
+
+/* Command line of a process with tabs between the arguments, 0 if unusable */
+static int
+readcmdline(pid_t pid, char *buf, size_t size)
+{
+    char path[64];
+    size_t n, i;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+    if (!(f = fopen(path, "r")))
+        return 0;
+    n = fread(buf, 1, size - 1, f);
+    fclose(f);
+    /* A truncated command line would start something else */
+    if (n == 0 || n == size - 1)
+        return 0;
+    if (buf[n - 1] == '\0')
+        n--;
+    for (i = 0; i < n; i++) {
+        if (buf[i] == '\t' || buf[i] == '\n')
+            return 0;
+        if (buf[i] == '\0')
+            buf[i] = '\t';
+    }
+    buf[n] = '\0';
+    return 1;
+}
+
+/* Write the session file, skipped when it would not change */
+static void
+sessionsave(void)
+{
+    char cmd[4096], tmp[sizeof(sessionpath) + 8];
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f;
+    Client *c;
+    Monitor *m;
+    int ok;
+
+    sessiondue = 0;
+    /* Saving halfway through a restore would lose the windows still coming */
+    if (replaying || restoreend || !*sessionpath)
+        return;
+    if (!(f = open_memstream(&buf, &len))) {
+        wm_log("Cannot save the session: %s\n", strerror(errno));
+        return;
+    }
+    fprintf(f, "wm-session\t1\n");
+    for (m = mons; m; m = m->next)
+        fprintf(f, "monitor\t%d\t%d\t%.3f\n", m->num, m->workspace, m->mfact);
+    for (c = clients; c; c = c->next) {
+        /* Dialogs come back with their application, the scratchpad by itself */
+        if (c->parent || c == scratch || c->pid <= 1 ||
+            strpbrk(c->class, "\t\n") || strpbrk(c->instance, "\t\n") ||
+            !readcmdline(c->pid, cmd, sizeof(cmd)))
+            continue;
+        fprintf(f, "client\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%s\t%s\t%s\n",
+                c->workspace, c->mon->num, c->isfloating, c->x, c->y, c->w, c->h,
+                c->pid, c->class, c->instance, cmd);
+    }
+    fclose(f);
+    if (sessionlast && len == sessionlastlen && !memcmp(buf, sessionlast, len)) {
+        free(buf);
+        return;
+    }
+
+    /* Replace the file whole so a crash never leaves half a session */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", sessionpath);
+    if (!(f = fopen(tmp, "w"))) {
+        wm_log("Cannot save the session to %s: %s\n", tmp, strerror(errno));
+        free(buf);
+        return;
+    }
+    ok = fwrite(buf, 1, len, f) == len;
+    if (fclose(f) != 0 || !ok || rename(tmp, sessionpath) < 0) {
+        wm_log("Cannot save the session to %s: %s\n", sessionpath, strerror(errno));
+        unlink(tmp);
+        free(buf);
+        return;
+    }
+    free(sessionlast);
+    sessionlast = buf;
+    sessionlastlen = len;
+}
+
+/* Save the session a little after a change, together with those that follow */
+static void
+sessionchanged(void)
+{
+    if (!sessiondue && SESSION_SAVE_DELAY_S > 0 && !replaying)
+        sessiondue = now_ns() + SESSION_SAVE_DELAY_S * 1000000000ll;
+}
+
+/* Relaunch the saved session, when starting without windows to adopt */
+static void
+restoresession(void)
+{
+    char *line = NULL, *rest, *f[11];
+    const char *argv[64];
+    size_t size = 0;
+    Monitor *m;
+    Slot sl, *ns;
+    FILE *fp;
+    int i, n, launches = 0;
+
+    if (!SESSION_RESTORE || replaying || !(fp = fopen(sessionpath, "r")))
+        return;
+    if (getline(&line, &size, fp) < 0 || strcmp(line, "wm-session\t1\n")) {
+        wm_log("Ignoring session %s of another version\n", sessionpath);
+        goto out;
+    }
+    while (getline(&line, &size, fp) > 0) {
+        line[strcspn(line, "\n")] = '\0';
+        rest = line;
+        for (n = 0; n < 11 && rest; n++)
+            f[n] = strsep(&rest, "\t");
+
+        if (n == 4 && !strcmp(f[0], "monitor")) {
+            int ws = atoi(f[2]);
+            float mfact = strtof(f[3], NULL);
+            for (m = mons; m && m->num != atoi(f[1]); m = m->next);
+            if (m && ws >= 1 && ws <= 9)
+                m->workspace = ws;
+            if (m && mfact >= 0.1 && mfact <= 0.9)
+                m->mfact = mfact;
+            continue;
+        }
+        if (n != 11 || !rest || strcmp(f[0], "client"))
+            continue;
+
+        memset(&sl, 0, sizeof(sl));
+        sl.workspace = atoi(f[1]);
+        sl.mon = atoi(f[2]);
+        sl.isfloating = atoi(f[3]) != 0;
+        sl.x = atoi(f[4]);
+        sl.y = atoi(f[5]);
+        sl.w = atoi(f[6]);
+        sl.h = atoi(f[7]);
+        sl.pid = atoi(f[8]);
+        snprintf(sl.class, sizeof(sl.class), "%s", f[9]);
+        snprintf(sl.instance, sizeof(sl.instance), "%s", f[10]);
+        if (sl.workspace < 1 || sl.workspace > 9)
+            continue;
+
+        /* Windows that shared a process share its launch */
+        for (i = 0; i < nslots && slots[i].pid != sl.pid; i++);
+        if (i < nslots) {
+            sl.launched = slots[i].launched;
+        } else {
+            for (n = 0; n < 63 && rest; n++)
+                argv[n] = strsep(&rest, "\t");
+            argv[n] = NULL;
+            if (rest) {
+                wm_log("Session command %s has too many arguments\n", argv[0]);
+                continue;
+            }
+            if ((sl.launched = spawnon(argv, sl.workspace)) <= 0)
+                continue;
+            launches++;
+        }
+
+        if (!(ns = realloc(slots, (nslots + 1) * sizeof(Slot)))) {
+            wm_log("Failed to allocate memory to restore the session\n");
+            break;
+        }
+        slots = ns;
+        slots[nslots++] = sl;
+    }
+    if (nslots) {
+        restoreleft = nslots;
+        restoreend = now_ns() + SESSION_RESTORE_TIMEOUT_S * 1000000000ll;
+        clock_gettime(CLOCK_MONOTONIC, &restorestart);
+        wm_log("Restoring %d windows of %d commands from %s\n", nslots, launches, sessionpath);
+    }
+    publishstate();
+out:
+    free(line);
+    fclose(fp);
+}
+
+/* Send a window of the session being restored where it was saved */
+static void
+sessionclaim(Client *c)
+{
+    pid_t anc[4];
+    Slot *best = NULL;
+    Monitor *m;
+    int i, j, nanc = 0;
+
+    /* _NET_WM_PID may belong to a process forked by the launched one */
+    for (pid_t pid = c->pid; pid > 1 && nanc < 4; pid = parentpid(pid))
+        anc[nanc++] = pid;
+    for (i = 0; i < nslots; i++) {
+        if (slots[i].win || strcmp(slots[i].class, c->class) ||
+            strcmp(slots[i].instance, c->instance))
+            continue;
+        for (j = 0; j < nanc && anc[j] != slots[i].launched; j++);
+        if (j < nanc) {
+            best = &slots[i];
+            break;
+        }
+        if (!best)
+            best = &slots[i];
+    }
+    if (!best)
+        return;
+
+    best->win = c->win;
+    restoreleft--;
+    for (m = mons; m && m->num != best->mon; m = m->next);
+    if (m)
+        c->mon = m;
+    c->workspace = best->workspace;
+    c->isfloating = best->isfloating;
+    if (c->isfloating && m) {
+        c->x = best->x;
+        c->y = best->y;
+        c->w = best->w;
+        c->h = best->h;
+        c->placed = 1;
+    } else if (c->isfloating) {
+        placefloating(c);
+    }
+    c->held = 1;
+}
+
+/* Give back the slot of a window that was refused after claiming it */
+static void
+sessionrelease(Client *c)
+{
+    for (int i = 0; i < nslots; i++) {
+        if (slots[i].win == c->win) {
+            slots[i].win = None;
+            restoreleft++;
+            return;
+        }
+    }
+}
+
+/* All saved windows are back or waiting for them timed out: put them in
+ * their saved order, lay out each output once and map what is shown */
+static void
+restoredone(void)
+{
+    Client *c, *head = NULL, **tail = &head, **pc;
+    int i, n = 0;
+
+    for (i = 0; i < nslots; i++) {
+        if (!slots[i].win)
+            continue;
+        for (pc = &clients; *pc && ((*pc)->win != slots[i].win || !(*pc)->held);
+             pc = &(*pc)->next);
+        if (!(c = *pc))
+            continue;  /* Gone again before the restore finished */
+        *pc = c->next;
+        *tail = c;
+        tail = &c->next;
+        n++;
+    }
+    *tail = clients;
+    clients = head;
+
+    for (c = clients, i = 0; i < n; c = c->next, i++) {
+        c->held = 0;
+        if (c->isfloating)
+            XMoveResizeWindow(dpy, c->win, c->x, c->y, c->w, c->h);
+    }
+    wm_log("Restored %d of %d windows in %.0fms\n", n, nslots, elapsed_ms(&restorestart));
+    free(slots);
+    slots = NULL;
+    nslots = restoreleft = 0;
+    restoreend = 0;
+
+    arrange(NULL);
+    for (c = clients, i = 0; i < n; c = c->next, i++)
+        setvisible(c, ISVISIBLE(c));
+    /* Transients of restored windows, mapped after them to stay above */
+    for (c = clients; c; c = c->next)
+        if (c->held) {
+            c->held = 0;
+            XMoveResizeWindow(dpy, c->win, c->x, c->y, c->w, c->h);
+            setvisible(c, ISVISIBLE(c));
+        }
+    if (!sel)
+        for (c = clients, i = 0; i < n; c = c->next, i++)
+            if (c->mon == selmon && ISVISIBLE(c) && !c->hidden) {
+                focus(c);
+                break;
+            }
+}
+
+/* Milliseconds until the next session deadline, -1 if there is none */
+static int
+sessiontimeout(void)
+{
+    long long next = sessiondue;
+
+    if (restoreend && (!next || restoreend < next))
+        next = restoreend;
+    if (!next)
+        return -1;
+    next -= now_ns();
+    return next > 0 ? next / 1000000 + 1 : 0;
+}
+
+static void
+sessiontick(void)
+{
+    long long now = now_ns();
+
+    if (restoreend && now >= restoreend) {
+        wm_log("Gave up waiting for %d windows of the session\n", restoreleft);
+        restoredone();
+    }
+    if (sessiondue && now >= sessiondue)
+        sessionsave();
+}
+
+/* Process to stop for a window: its process group when the application
+ * runs in a group of its own (as spawned ones do), else the process */
+static pid_t
+freezetarget(pid_t pid)
+{
+    pid_t pgid = getpgid(pid);
+
+    if (pgid > 1 && pgid != getpgrp())
+        return -pgid;
+    return pid;
+}
+
+/* Stop or resume the processes of frozen-policy clients sharing c's pid.
+ * A process keeps running as long as any of its windows is visible. */
+static void
+updatefreeze(Client *c)
+{
+    Client *i;
+    int hide = 1;
+
+    if (!c->freeze || c->pid <= 1 || c->pid == getpid())
+        return;
+    for (i = clients; i; i = i->next)
+        if (i->pid == c->pid && ISVISIBLE(i))
+            hide = 0;
+    if (hide == c->frozen)
+        return;
+    if (kill(freezetarget(c->pid), hide ? SIGSTOP : SIGCONT) < 0) {
+        wm_log("Cannot %s process %d: %s\n", hide ? "stop" : "resume",
+               c->pid, strerror(errno));
+        return;
+    }
+    wm_log("%s process %d (%s)\n", hide ? "Stopped" : "Resumed", c->pid, c->class);
+    for (i = clients; i; i = i->next)
+        if (i->pid == c->pid)
+            i->frozen = hide;
+}
+
+/* Resume the process of a frozen client without showing its windows */
+static void
+thaw(Client *c)
+{
+    if (!c->frozen)
+        return;
+    kill(freezetarget(c->pid), SIGCONT);
+    for (Client *i = clients; i; i = i->next)
+        if (i->pid == c->pid)
+            i->frozen = 0;
+}
+
+/* Resume everything, before exiting or handing over to a new instance */
+static void
+thawall(void)
 {
-    Window root_return, parent_return, *children;
-    unsigned int nchildren;
-    Client *c;
+    for (Client *c = clients; c; c = c->next)
+        thaw(c);
+}
+
+/* Advertise the window state in WM_STATE and _NET_WM_STATE */
+static void
+setwinstate(Client *c, int visible)
+{
+    long wmstate[] = { visible ? NormalState : IconicState, None };
+    Atom netstate[2];
+    int n = 0;
+
+    XChangeProperty(dpy, c->win, atom[WMStateProp], atom[WMStateProp], 32,
+                    PropModeReplace, (unsigned char *)wmstate, 2);
+    if (!visible)
+        netstate[n++] = atom[NetWMStateHidden];
+    if (c->isfullscreen)
+        netstate[n++] = atom[NetWMStateFullscreen];
+    XChangeProperty(dpy, c->win, atom[NetWMState], XA_ATOM, 32,
+                    PropModeReplace, (unsigned char *)netstate, n);
+}
 
-    if (!XQueryTree(dpy, root, &root_return, &parent_return, &children, &nchildren))
+/* Map or unmap a client as its workspace is shown or hidden.
+ * The workspace must already say whether the client is visible; a
+ * stopped process is resumed before its window maps. */
+static void
+setvisible(Client *c, int visible)
+{
+    /* Kept unmapped by monocle whether or not its workspace is shown */
+    if (c->hidden)
         return;
+    if (visible) {
+        updatefreeze(c);
+        setwinstate(c, 1);
+        XMapWindow(dpy, c->win);
+    } else {
+        XUnmapWindow(dpy, c->win);
+        setwinstate(c, 0);
+        updatefreeze(c);
+    }
+}
 
-    for (unsigned int i = 0; i < nchildren; i++) {
-        if (children[i] != root) {
-            c = malloc(sizeof(Client));
-            if (!c) {
-                wm_log("Fatal: failed to allocate memory for client during scan\n");
-                if (children) XFree(children);
-                return;
-            }
-            c->win = children[i];
-            c->next = clients;
-            c->isfloating = 0;
-            c->isfullscreen = 0;
-            clients = c;
-            XMapWindow(dpy, children[i]);
-        }
+/* Hide or show a tiled client of a monocle workspace */
+static void
+sethidden(Client *c, int hidden)
+{
+    if (hidden) {
+        setvisible(c, 0);
+        c->hidden = 1;
+    } else {
+        c->hidden = 0;
+        setvisible(c, ISVISIBLE(c));
     }
-    if (children)
-        XFree(children);
-    arrange();
 }
 
 /* Workspace Management */
@@ -766,17 +4500,18 @@ sendtoworkspace(const char **arg)
         return;
 
     /* Check if target workspace has room */
-    if (count_windows_in_workspace(workspace) >= MAX_WINDOWS) {
+    if (count_windows_in_workspace(sel->mon, workspace) >= MAX_WINDOWS) {
         wm_log("Cannot move window: workspace %d is full (max %d windows)\n",
                 workspace, MAX_WINDOWS);
         return;
     }
 
     sel->workspace = workspace;
-    if (workspace != current_workspace)
-        XUnmapWindow(dpy, sel->win);
+    cgroupmove(sel);
+    if (workspace != sel->mon->workspace)
+        setvisible(sel, 0);
     focus(NULL);
-    arrange();
+    arrange(sel->mon);
 }
 
 void
@@ -786,20 +4521,132 @@ switchworkspace(const char **arg)
         return;
 
     int workspace = atoi(arg[0]);
-    if (workspace < 1 || workspace > 9 || workspace == current_workspace)
+    if (workspace < 1 || workspace > 9 || workspace == selmon->workspace)
         return;
 
-    /* Hide current workspace windows */
-    for (Client *c = clients; c; c = c->next) {
-        if (c->workspace == current_workspace)
-            XUnmapWindow(dpy, c->win);
-        else if (c->workspace == workspace)
-            XMapWindow(dpy, c->win);
-    }
+    /* Hide current workspace windows of the focused monitor */
+    int old = selmon->workspace;
+    selmon->workspace = workspace;
+    for (Client *c = clients; c; c = c->next)
+        if (c->mon == selmon && c->workspace == old)
+            setvisible(c, 0);
 
-    current_workspace = workspace;
+    /* Lay out first so windows placed by rules are mapped in place */
     focus(NULL);
-    arrange();
+    updateweights();
+    arrange(selmon);
+    for (Client *c = clients; c; c = c->next)
+        if (c->mon == selmon && ISVISIBLE(c))
+            setvisible(c, 1);
+}
+
+/* Monitor next to the focused one, dir > 0 is forward */
+static Monitor *
+dirtomon(int dir)
+{
+    Monitor *m;
+
+    if (dir > 0) {
+        if (!(m = selmon->next))
+            m = mons;
+    } else if (selmon == mons) {
+        for (m = mons; m->next; m = m->next);
+    } else {
+        for (m = mons; m->next != selmon; m = m->next);
+    }
+    return m;
+}
+
+void
+focusmon(const char **arg)
+{
+    Client *c;
+
+    if (!arg || !arg[0] || !mons->next)
+        return;
+
+    selmon = dirtomon(atoi(arg[0]));
+    for (c = clients; c; c = c->next)
+        if (c->mon == selmon && ISVISIBLE(c))
+            break;
+    if (c)
+        focus(c);
+    else
+        publishstate();
+}
+
+void
+sendtomon(const char **arg)
+{
+    Monitor *m, *old;
+
+    if (!sel || !arg || !arg[0] || !mons->next)
+        return;
+
+    m = dirtomon(atoi(arg[0]));
+    if (m == sel->mon)
+        return;
+
+    if (count_windows_in_workspace(m, m->workspace) >= MAX_WINDOWS) {
+        wm_log("Cannot move window: monitor %d is full (max %d windows)\n",
+                m->num, MAX_WINDOWS);
+        return;
+    }
+
+    /* Floating windows keep their offset within the output */
+    old = sel->mon;
+    sel->x += m->mx - old->mx;
+    sel->y += m->my - old->my;
+    sel->mon = m;
+    sel->workspace = m->workspace;
+    cgroupmove(sel);
+    arrange(old);
+    arrange(m);
+    focus(sel);
+}
+
+/* Show or hide the scratchpad as a floating overlay on the focused monitor */
+void
+togglescratch(const char **arg)
+{
+    Client *c;
+
+    if (!scratch) {
+        /* First use: launch it once and show it when it maps */
+        CmdStat *cs = cmdstat(arg);
+        if (!scratchlaunched || (cs && !cs->running)) {
+            spawn(arg);
+            scratchlaunched = 1;
+        }
+        scratchshow = 1;
+        return;
+    }
+
+    if (scratch->mon == selmon && ISVISIBLE(scratch)) {
+        scratch->workspace = 0;
+        setvisible(scratch, 0);
+        spatialsync(scratch);
+        for (c = clients; c && !(c->mon == selmon && ISVISIBLE(c)); c = c->next);
+        if (c) {
+            focus(c);
+        } else {
+            sel = NULL;
+            XSetInputFocus(dpy, root, RevertToPointerRoot, CurrentTime);
+            publishstate();
+        }
+        return;
+    }
+
+    /* One configure, one map: nothing else on the workspace moves */
+    if (ISVISIBLE(scratch))
+        XUnmapWindow(dpy, scratch->win);
+    placescratch(scratch, selmon);
+    scratch->workspace = selmon->workspace;
+    XMoveResizeWindow(dpy, scratch->win, scratch->x, scratch->y, scratch->w, scratch->h);
+    spatialsync(scratch);
+    setvisible(scratch, 1);
+    XRaiseWindow(dpy, scratch->win);
+    focus(scratch);
 }
 
 void
@@ -820,6 +4667,8 @@ buttonpress(XEvent *e)
             if (ev->button == Button1 && ev->state & MODKEY) {
                 dragx = ev->x_root;
                 dragy = ev->y_root;
+                dragnx = c->x;
+                dragny = c->y;
                 dragclient = c;
                 drag_started = 1;
                 XSetWindowBorderWidth(dpy, c->win, BORDER_WIDTH * 2);
@@ -835,53 +4684,66 @@ buttonpress(XEvent *e)
 }
 
 void
-buttonrelease(XEvent *e __attribute__((unused)))
+buttonrelease(XEvent *e)
 {
-    Client *c;
-    Window dummy;
-    int rx, ry, x, y;
-    unsigned int mask;
+    XButtonEvent *ev = &e->xbutton;
+    Client *c = NULL;
+    Monitor *m;
 
     if (!drag_started)
         return;
 
-    /* Find window under pointer */
-    if (XQueryPointer(dpy, root, &dummy, &dummy, &rx, &ry, &x, &y, &mask)) {
-        Window win_under;
-        int win_x, win_y;
-        XTranslateCoordinates(dpy, root, root, rx, ry, &win_x, &win_y, &win_under);
+    if (dragclient->isfloating) {
+        /* Floating windows stay where they were dropped */
+        dragclient->x = dragnx;
+        dragclient->y = dragny;
+    } else {
+        /* Drop target from the spatial index: the window under the
+         * pointer, or the nearest tiled one when dropped into a gap */
+        for (m = mons; m; m = m->next)
+            if (ev->x_root >= m->mx && ev->x_root < m->mx + m->mw &&
+                ev->y_root >= m->my && ev->y_root < m->my + m->mh)
+                break;
+        if (m && !(c = clientat(m, ev->x_root, ev->y_root, dragclient)))
+            c = tilednear(m, ev->x_root, ev->y_root, dragclient);
+    }
 
-        /* Find client under pointer */
-        for (c = clients; c; c = c->next) {
-            if (c->win == win_under && c != dragclient &&
-                c->workspace == current_workspace) {
-                /* Swap windows in linked list */
-                Client *prev_drag = NULL, *prev_c = NULL;
-                Client *t;
-
-                /* Find nodes */
-                for (t = clients; t && t != dragclient; t = t->next)
-                    prev_drag = t;
-                for (t = clients; t && t != c; t = t->next)
-                    prev_c = t;
-
-                /* Swap positions */
-                if (prev_drag)
-                    prev_drag->next = c;
-                else
-                    clients = c;
-
-                if (prev_c)
-                    prev_c->next = dragclient;
-                else
-                    clients = dragclient;
-
-                t = dragclient->next;
-                dragclient->next = c->next;
-                c->next = t;
+    if (c) {
+        /* Swap windows in linked list */
+        Client *prev_drag = NULL, *prev_c = NULL;
+        Client *t;
+
+        /* Find nodes */
+        for (t = clients; t && t != dragclient; t = t->next)
+            prev_drag = t;
+        for (t = clients; t && t != c; t = t->next)
+            prev_c = t;
+
+        /* Swap positions */
+        if (prev_drag)
+            prev_drag->next = c;
+        else
+            clients = c;
 
-                break;
-            }
+        if (prev_c)
+            prev_c->next = dragclient;
+        else
+            clients = dragclient;
+
+        t = dragclient->next;
+        dragclient->next = c->next;
+        c->next = t;
+
+        /* Dropped on another monitor: trade places there too */
+        if (c->mon != dragclient->mon) {
+            m = c->mon;
+            int ws = c->workspace;
+            c->mon = dragclient->mon;
+            c->workspace = dragclient->workspace;
+            dragclient->mon = m;
+            dragclient->workspace = ws;
+            cgroupmove(c);
+            cgroupmove(dragclient);
         }
     }
 
@@ -889,7 +4751,7 @@ buttonrelease(XEvent *e __attribute__((unused)))
     XSetWindowBorderWidth(dpy, dragclient->win, BORDER_WIDTH);
     dragclient = NULL;
     drag_started = 0;
-    arrange();
+    arrange(NULL);
 }
 
 void
@@ -913,6 +4775,8 @@ motionnotify(XEvent *e)
 
     if (validate_window_position(new_x, new_y)) {
         XMoveWindow(dpy, dragclient->win, new_x, new_y);
+        dragnx = new_x;
+        dragny = new_y;
     }
 }
 
@@ -929,7 +4793,9 @@ clearworkspace(const char **arg)
     Client *c, *next;
     for (c = clients; c; c = next) {
         next = c->next;
-        if (c->workspace == workspace) {
+        if (c->mon == selmon && c->workspace == workspace) {
+            /* A stopped process would never notice its connection closing */
+            thaw(c);
             XKillClient(dpy, c->win);
         }
     }
@@ -946,15 +4812,15 @@ showworkspace(const char **arg __attribute__((unused)))
     int x, y, width = 200, height = 50;
     XFontStruct *font;
 
-    snprintf(buf, sizeof(buf), "Workspace: %d", current_workspace);
+    snprintf(buf, sizeof(buf), "Workspace: %d", selmon->workspace);
 
     /* Create centered notification window */
     wa.override_redirect = True;
     wa.background_pixel = 0x282a36;
     wa.border_pixel = ACTIVE_BORDER;
 
-    x = (attr.width - width) / 2;
-    y = (attr.height - height) / 2;
+    x = selmon->mx + (selmon->mw - width) / 2;
+    y = selmon->my + (selmon->mh - height) / 2;
 
     w = XCreateWindow(dpy, root, x, y, width, height, 2,
                      DefaultDepth(dpy, screen), CopyFromParent,
@@ -992,6 +4858,9 @@ showworkspace(const char **arg __attribute__((unused)))
 void
 reload(const char **arg __attribute__((unused)))
 {
+    if (replaying)
+        return;
+
     /* Recompile first */
     reload_keys(NULL);
 
@@ -1007,7 +4876,12 @@ reload(const char **arg __attribute__((unused)))
     }
     path[len] = '\0';
 
+    /* Leave the client list for the new instance to adopt */
+    savestate();
+    thawall();
+
     /* Execute the new binary */
+    PROBE1(restart, nclients);
     execl(path, path, NULL);
     
     wm_log("Failed to reload window manager\n");
@@ -1020,6 +4894,9 @@ reload_keys(const char **arg __attribute__((unused)))
     char path[PATH_MAX];
     ssize_t len;
 
+    if (replaying)
+        return;
+
     /* Get path to executable directory */
     len = readlink("/proc/self/exe", path, sizeof(path) - 1);
     if (len < 0) {
@@ -1046,6 +4923,7 @@ reload_keys(const char **arg __attribute__((unused)))
     /* Force reload of config.h by recompiling */
     #undef CONFIG_H
     #include "config.h"
+    (void)rules;  /* Rules stay compiled from startup */
 
     /* Re-grab all keys from refreshed config */
     for (long unsigned int i = 0; i < sizeof(keys)/sizeof(keys[0]); i++) {
@@ -1058,94 +4936,668 @@ reload_keys(const char **arg __attribute__((unused)))
     wm_log("Reloaded key bindings\n");
 }
 
-/* Add this function after scan() */
+/* Event tracing
+ * With WM_TRACE set, every dispatched event is appended to that file with
+ * its handler time and request count, see wmtrace.h. "wm -r trace" feeds
+ * a trace back through the handlers against a scratch server. */
+static const char *evnames[LASTEvent] = {
+    [KeyPress] = "KeyPress", [KeyRelease] = "KeyRelease",
+    [ButtonPress] = "ButtonPress", [ButtonRelease] = "ButtonRelease",
+    [MotionNotify] = "MotionNotify", [EnterNotify] = "EnterNotify",
+    [LeaveNotify] = "LeaveNotify", [FocusIn] = "FocusIn", [FocusOut] = "FocusOut",
+    [Expose] = "Expose", [CreateNotify] = "CreateNotify",
+    [DestroyNotify] = "DestroyNotify", [UnmapNotify] = "UnmapNotify",
+    [MapNotify] = "MapNotify", [MapRequest] = "MapRequest",
+    [ReparentNotify] = "ReparentNotify", [ConfigureNotify] = "ConfigureNotify",
+    [ConfigureRequest] = "ConfigureRequest", [PropertyNotify] = "PropertyNotify",
+    [SelectionClear] = "SelectionClear", [SelectionRequest] = "SelectionRequest",
+    [SelectionNotify] = "SelectionNotify", [ClientMessage] = "ClientMessage",
+    [MappingNotify] = "MappingNotify",
+};
+
+static const char *
+eventname(int type)
+{
+    static char buf[24];
+
+    if (type >= 0 && type < LASTEvent && evnames[type])
+        return evnames[type];
+    if (type == LASTEvent)
+        return "Extension";
+    snprintf(buf, sizeof(buf), "Event%d", type);
+    return buf;
+}
+
+/* Size of the Xlib structure for an event type */
+static size_t
+eventsize(int type)
+{
+    switch (type) {
+    case KeyPress: case KeyRelease: return sizeof(XKeyEvent);
+    case ButtonPress: case ButtonRelease: return sizeof(XButtonEvent);
+    case MotionNotify: return sizeof(XMotionEvent);
+    case EnterNotify: case LeaveNotify: return sizeof(XCrossingEvent);
+    case DestroyNotify: return sizeof(XDestroyWindowEvent);
+    case UnmapNotify: return sizeof(XUnmapEvent);
+    case MapNotify: return sizeof(XMapEvent);
+    case MapRequest: return sizeof(XMapRequestEvent);
+    case ConfigureNotify: return sizeof(XConfigureEvent);
+    case ConfigureRequest: return sizeof(XConfigureRequestEvent);
+    case PropertyNotify: return sizeof(XPropertyEvent);
+    case ClientMessage: return sizeof(XClientMessageEvent);
+    default: return sizeof(XEvent);
+    }
+}
+
+/* Where a trace left by an earlier instance ends, 0 if it cannot be
+ * appended to */
+static int
+traceresume(FILE *f)
+{
+    WMTraceHeader h;
+    WMTraceRecord r;
+    struct timespec now;
+    uint64_t last = 0, since;
+
+    rewind(f);
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != WMTRACE_MAGIC ||
+        h.version != WMTRACE_VERSION)
+        return 0;
+    while (fread(&r, sizeof(r), 1, f) == 1 && !fseek(f, r.len, SEEK_CUR))
+        last = r.time_ns + r.dur_ns;
+
+    /* Continue from the wall clock time since the header was written,
+     * never before the last recorded event */
+    clock_gettime(CLOCK_REALTIME, &now);
+    since = now.tv_sec > (time_t)h.start ?
+            (now.tv_sec - h.start) * 1000000000ull + now.tv_nsec : 0;
+    tracebase = since > last ? since : last;
+    fseek(f, 0, SEEK_END);
+    return 1;
+}
+
 static void
-adopt_windows(void)
+setuptrace(void)
 {
-    Atom type;
-    int format;
-    unsigned long num_items, bytes_after;
-    unsigned char *data = NULL;
-    Window *wins;
-    unsigned long *workspaces;
+    const char *path = getenv("WM_TRACE");
+    WMTraceHeader h = { 0 };
 
-    /* Get saved windows */
-    if (XGetWindowProperty(dpy, root, XInternAtom(dpy, "_WM_WINDOWS", False),
-                          0, 1024, True, XA_WINDOW,
-                          &type, &format, &num_items, &bytes_after, &data) == Success && data) {
-        wins = (Window *)data;
-        
-        /* Get saved workspaces */
-        if (XGetWindowProperty(dpy, root, XInternAtom(dpy, "_WM_WORKSPACES", False),
-                              0, 1024, True, XA_CARDINAL,
-                              &type, &format, &num_items, &bytes_after, &data) == Success && data) {
-            workspaces = (unsigned long *)data;
-            
-            /* Get window states */
-            unsigned char *states = NULL;
-            if (XGetWindowProperty(dpy, root, XInternAtom(dpy, "_WM_WINDOW_STATES", False),
-                                  0, 1024, True, XA_CARDINAL,
-                                  &type, &format, &num_items, &bytes_after, &data) == Success && data) {
-                states = (unsigned char *)data;
-            }
+    if (!path || !*path)
+        return;
+    /* Appending keeps one trace across reloads */
+    if (!(tracefp = fopen(path, "a+b"))) {
+        wm_log("Cannot open trace %s: %s\n", path, strerror(errno));
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tracestart);
+    fseek(tracefp, 0, SEEK_END);
+    if (ftell(tracefp) == 0) {
+        h.magic = WMTRACE_MAGIC;
+        h.version = WMTRACE_VERSION;
+        h.root = root;
+        h.width = attr.width;
+        h.height = attr.height;
+        h.start = time(NULL);
+        fwrite(&h, sizeof(h), 1, tracefp);
+    } else if (!traceresume(tracefp)) {
+        wm_log("Not appending to %s, it is not a version %d trace\n", path, WMTRACE_VERSION);
+        fclose(tracefp);
+        tracefp = NULL;
+        return;
+    }
+    wm_log("Recording events to %s\n", path);
+}
 
-            /* Readopt windows */
-            for (unsigned long i = 0; i < num_items; i++) {
-                Client *c = malloc(sizeof(Client));
-                if (!c) continue;
-                
-                XWindowAttributes wa;
-                if (!XGetWindowAttributes(dpy, wins[i], &wa)) {
-                    free(c);
-                    continue;
-                }
-                
-                c->win = wins[i];
-                c->workspace = workspaces[i];
-                c->next = clients;
-                c->isfloating = states ? states[i] : 0;
-                c->isfullscreen = 0;
-                c->x = wa.x;
-                c->y = wa.y;
-                c->w = wa.width;
-                c->h = wa.height;
-                clients = c;
-                
-                /* Reset window attributes */
-                XSetWindowAttributes swa;
-                swa.event_mask = EnterWindowMask | KeyPressMask;
-                swa.override_redirect = True;
-                swa.border_pixel = INACTIVE_BORDER;
-                XChangeWindowAttributes(dpy, c->win, 
-                                     CWEventMask | CWOverrideRedirect | CWBorderPixel,
-                                     &swa);
-
-                /* Reattach our event handlers */
-                XGrabButton(dpy, Button1, MODKEY, c->win, True,
-                           ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
-                           GrabModeAsync, GrabModeAsync, None, None);
-                
-                if (c->workspace == current_workspace) {
-                    XMapWindow(dpy, c->win);
-                    XSetInputFocus(dpy, c->win, RevertToPointerRoot, CurrentTime);
-                    sel = c;  // Make this the selected window
-                }
+static void
+tracerecord(XEvent *ev, const struct timespec *t0, double ms, unsigned long requests)
+{
+    WMTraceRecord r = { 0 };
+
+    r.time_ns = tracebase + (t0->tv_sec - tracestart.tv_sec) * 1000000000ull +
+                (t0->tv_nsec - tracestart.tv_nsec);
+    r.dur_ns = ms * 1e6;
+    r.requests = requests;
+    r.type = ev->type;
+    r.len = eventsize(ev->type);
+    if (ev->type == KeyPress || ev->type == KeyRelease)
+        r.keysym = XkbKeycodeToKeysym(dpy, ev->xkey.keycode, 0, 0);
+    if (fwrite(&r, sizeof(r), 1, tracefp) != 1 || fwrite(ev, r.len, 1, tracefp) != 1) {
+        wm_log("Trace write failed, recording stopped: %s\n", strerror(errno));
+        fclose(tracefp);
+        tracefp = NULL;
+    }
+}
+
+/* Which subscription or grab made the server send an event */
+static int
+eventsource(XEvent *ev)
+{
+    switch (ev->type) {
+    case KeyPress: case KeyRelease:
+        return MaskKeyGrab;
+    case ButtonPress: case ButtonRelease:
+        return drag_started ? MaskDragGrab : MaskButtonGrab;
+    case MotionNotify:
+        return MaskDragGrab;
+    case EnterNotify: case LeaveNotify:
+        return MaskEnterWindow;
+    case MapRequest: case ConfigureRequest: case CirculateRequest:
+        return MaskSubstructureRedirect;
+    case ConfigureNotify:
+        return ev->xconfigure.window == root ? MaskStructureNotify : MaskSubstructureNotify;
+    case CreateNotify: case DestroyNotify: case UnmapNotify: case MapNotify:
+    case ReparentNotify: case GravityNotify: case CirculateNotify:
+        return MaskSubstructureNotify;
+    case PropertyNotify:
+        return MaskPropertyChange;
+    default:
+        return ev->type >= LASTEvent ? MaskExtension : MaskOther;
+    }
+}
+
+/* Stall watchdog
+ * The event loop leaves a breadcrumb (handler, event type, key) while it
+ * handles something. A watchdog thread that finds the same breadcrumb older
+ * than WATCHDOG_BUDGET_MS logs it and signals the main thread, which writes
+ * its own backtrace to the log. Every handler slower than 16ms, 100ms or 1s
+ * is counted, in total and per minute over the last hour. */
+static long long
+now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ll + t.tv_nsec;
+}
+
+/* SIGURG on the main thread: dump where it is stuck, using only write(2) */
+static void
+stackdump(int sig __attribute__((unused)))
+{
+    static const char msg[] = "Backtrace of the stalled event loop (addr2line -e wm):\n";
+    void *frames[32];
+    int n, fd = logfile ? fileno(logfile) : STDERR_FILENO;
+
+    n = backtrace(frames, 32);
+    if (write(fd, msg, sizeof(msg) - 1) > 0)
+        backtrace_symbols_fd(frames, n, fd);
+}
+
+static void *
+watchdog(void *arg __attribute__((unused)))
+{
+    struct timespec tick = { 0, WATCHDOG_BUDGET_MS * 1000000l / 4 };
+
+    for (;;) {
+        nanosleep(&tick, NULL);
+        unsigned long seq = __atomic_load_n(&crumb.seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1) || seq == reportedseq)
+            continue;
+        long long start = __atomic_load_n(&crumb.start_ns, __ATOMIC_RELAXED);
+        const char *name = __atomic_load_n(&crumb.name, __ATOMIC_RELAXED);
+        int type = __atomic_load_n(&crumb.type, __ATOMIC_RELAXED);
+        unsigned long detail = __atomic_load_n(&crumb.detail, __ATOMIC_RELAXED);
+        double ms = (now_ns() - start) / 1e6;
+        /* Still the same handler: the breadcrumb was not torn */
+        if (ms < WATCHDOG_BUDGET_MS || __atomic_load_n(&crumb.seq, __ATOMIC_ACQUIRE) != seq)
+            continue;
+        __atomic_store_n(&reportedseq, seq, __ATOMIC_RELEASE);
+        wm_log("Stall: %s (event %d, detail 0x%lx) busy for %.0fms\n",
+               name, type, detail, ms);
+        pthread_kill(mainthread, SIGURG);
+    }
+    return NULL;
+}
+
+static void
+setupwatchdog(void)
+{
+    struct sigaction sa = { 0 };
+    pthread_t t;
+    void *frames[1];
+    sigset_t all, mask;
+
+    if (WATCHDOG_BUDGET_MS <= 0)
+        return;
+    backtrace(frames, 1);  /* Loads libgcc now rather than inside the handler */
+    sa.sa_handler = stackdump;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGURG, &sa, NULL);
+    mainthread = pthread_self();
+
+    /* Only the main thread takes the signals of the event loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &mask);
+    if (pthread_create(&t, NULL, watchdog, NULL) != 0)
+        wm_log("Cannot start the watchdog thread\n");
+    else
+        pthread_detach(t);
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+}
+
+static void
+watchbegin(const char *name, int type)
+{
+    __atomic_store_n(&crumb.name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&crumb.type, type, __ATOMIC_RELAXED);
+    __atomic_store_n(&crumb.detail, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&crumb.start_ns, now_ns(), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&crumb.seq, 1, __ATOMIC_RELEASE);
+}
+
+/* Add to the breadcrumb what the handler is doing, e.g. the bound key */
+static void
+watchdetail(unsigned long detail)
+{
+    __atomic_store_n(&crumb.detail, detail, __ATOMIC_RELAXED);
+}
+
+static void
+watchend(void)
+{
+    unsigned long seq = __atomic_add_fetch(&crumb.seq, 1, __ATOMIC_RELEASE) - 1;
+    double ms = (now_ns() - crumb.start_ns) / 1e6;
+    long minute = time(NULL) / 60;
+
+    for (unsigned int i = 0; i < NSTALL && ms >= stallms[i]; i++) {
+        stalls[i]++;
+        if (stallring[minute % 60].minute != minute) {
+            memset(&stallring[minute % 60], 0, sizeof(stallring[0]));
+            stallring[minute % 60].minute = minute;
+        }
+        stallring[minute % 60].n[i]++;
+    }
+    if (__atomic_load_n(&reportedseq, __ATOMIC_ACQUIRE) == seq)
+        wm_log("Stall in %s ended after %.0fms\n", crumb.name, ms);
+}
+
+/* Dispatch one X event to its handler */
+static void
+handleevent(XEvent *ev)
+{
+    unsigned long requests = nextrequest();
+    struct timespec t0;
+    HandlerStat *hs;
+    double ms;
+
+    wm_log("Processing event: %d\n", ev->type);
+    maskevents[eventsource(ev)]++;
+    watchbegin(eventname(ev->type < LASTEvent ? ev->type : LASTEvent), ev->type);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    PROBE2(event_entry, ev->type, ev->xany.window);
+    if (handler[ev->type])
+        handler[ev->type](ev);
+#ifdef XRANDR
+    else if (xrandr && (ev->type == rrevbase + RRScreenChangeNotify ||
+                        ev->type == rrevbase + RRNotify))
+        rrnotify(ev);
+#endif
+#ifdef XFIXES
+    else if (xfixes && ev->type == xfixesevbase + XFixesSelectionNotify)
+        xfixesnotify(ev);
+#endif
+#ifdef XDAMAGE
+    else if (damagemon && ev->type == damageevbase + XDamageNotify)
+        damagenotify(ev);
+#endif
+    ms = elapsed_ms(&t0);
+    watchend();
+    requests = (unsigned int)(nextrequest() - requests);
+    PROBE3(event_return, ev->type, ev->xany.window, requests);
+
+    hs = &hstats[ev->type < LASTEvent ? ev->type : LASTEvent];
+    hs->events++;
+    hs->requests += requests;
+    hs->total_ms += ms;
+    if (ms > hs->max_ms)
+        hs->max_ms = ms;
+    if (tracefp)
+        tracerecord(ev, &t0, ms, requests);
+}
+
+/* Input-first scheduling
+ * A deep queue of map, configure and property events can hold a hotkey
+ * back for as long as it takes to handle them all. Once INPUT_PRIORITY_DEPTH
+ * events are queued, key, button and drag motion events are taken out of the
+ * queue and run first, consecutive motions as one, and events made redundant
+ * by a later one still queued are dropped from the rest. */
+
+static Bool
+isinput(Display *d __attribute__((unused)), XEvent *ev, XPointer arg)
+{
+    unsigned long *ahead = (unsigned long *)arg;
+
+    if (ev->type == KeyPress || ev->type == KeyRelease || ev->type == ButtonPress ||
+        ev->type == ButtonRelease || ev->type == MotionNotify)
+        return True;
+    (*ahead)++;
+    return False;
+}
+
+/* Coalescing key of an event that only its last queued instance needs, or NULL */
+static Pending *
+pendingslot(const XEvent *ev, int add)
+{
+    Window win;
+    unsigned long detail;
+    unsigned int h, i;
+
+    switch (ev->type) {
+    case EnterNotify:
+        /* Focus follows the last crossing only */
+        if (ev->xcrossing.mode != NotifyNormal || ev->xcrossing.detail == NotifyInferior)
+            return NULL;
+        win = detail = 0;
+        break;
+    case PropertyNotify:
+        /* Titles and hints are read again anyway; selection transfers
+         * on other windows need every notification */
+        if (ev->xproperty.state != PropertyNewValue || !wintoclient(ev->xproperty.window))
+            return NULL;
+        win = ev->xproperty.window;
+        detail = ev->xproperty.atom;
+        break;
+    case ConfigureRequest:
+        /* A later request setting the same fields overrides this one;
+         * restacking relative to a sibling does not commute */
+        if (ev->xconfigurerequest.value_mask & CWStackMode)
+            return NULL;
+        win = ev->xconfigurerequest.window;
+        detail = ev->xconfigurerequest.value_mask;
+        break;
+    default:
+        return NULL;
+    }
+
+    h = (ev->type * 31u + win * 2654435761u + detail * 40503u) & (PENDINGSLOTS - 1);
+    for (i = 0; i < PENDINGSLOTS; i++, h = (h + 1) & (PENDINGSLOTS - 1)) {
+        Pending *p = &pending[h];
+        if (p->type == ev->type && p->win == win && p->detail == detail)
+            return p;
+        if (!p->type) {
+            if (!add)
+                return NULL;
+            p->type = ev->type;
+            p->win = win;
+            p->detail = detail;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* XCheckIfEvent predicate that only counts, so nothing leaves the queue */
+static Bool
+countpending(Display *d __attribute__((unused)), XEvent *ev,
+             XPointer arg __attribute__((unused)))
+{
+    Pending *p = pendingslot(ev, 1);
+
+    if (p)
+        p->left++;
+    return False;
+}
+
+/* Handle an event of a batch, timing how long presses and clicks waited */
+static void
+dispatch(XEvent *ev, long long batch)
+{
+    if (ev->type == KeyPress || ev->type == ButtonPress || ev->type == ButtonRelease) {
+        long long wait = now_ns() - batch;
+        inputevents++;
+        inputwait_ns += wait;
+        if (wait > inputwaitmax_ns)
+            inputwaitmax_ns = wait;
+    }
+    handleevent(ev);
+}
+
+/* Take input out of a deep queue and run it ahead of everything else */
+static void
+dispatchinput(long long batch)
+{
+    unsigned long ahead = 0;
+    XEvent ev, motion;
+    int havemotion = 0;
+
+    while (running && XCheckIfEvent(dpy, &ev, isinput, (XPointer)&ahead)) {
+        if (ahead) {
+            inputearly++;
+            inputovertook += ahead;
+            ahead = 0;
+        }
+        /* Drags place the window at the pointer, the last motion is enough */
+        if (ev.type == MotionNotify) {
+            if (havemotion)
+                coalesced[MotionNotify]++;
+            motion = ev;
+            havemotion = 1;
+            continue;
+        }
+        if (havemotion) {
+            dispatch(&motion, batch);
+            havemotion = 0;
+        }
+        dispatch(&ev, batch);
+    }
+    if (havemotion && running)
+        dispatch(&motion, batch);
+}
+
+/* Handle everything the server has sent */
+static void
+dispatchpending(void)
+{
+    XEvent ev;
+    Pending *p;
+    int n, deep;
+
+    while (running && XPending(dpy)) {
+        long long batch = now_ns();
+
+        n = QLength(dpy);
+        if (n > qdepthmax)
+            qdepthmax = n;
+        qdepth[n < 2 ? 0 : n < 8 ? 1 : n < 32 ? 2 : n < 128 ? 3 : 4]++;
+        deep = INPUT_PRIORITY_DEPTH > 0 && n >= INPUT_PRIORITY_DEPTH;
+        if (deep) {
+            dispatchinput(batch);
+            memset(pending, 0, sizeof(pending));
+            XCheckIfEvent(dpy, &ev, countpending, NULL);
+            n = QLength(dpy);
+        }
+
+        /* Only the events counted above, the next batch looks for input again */
+        while (running && n-- > 0 && QLength(dpy)) {
+            XNextEvent(dpy, &ev);
+            if (deep && (p = pendingslot(&ev, 0)) && --p->left > 0) {
+                coalesced[ev.type]++;
+                continue;
             }
-            if (states)
-                XFree(states);
-            XFree(workspaces);
+            dispatch(&ev, batch);
+        }
+    }
+}
+
+/* Stand-in windows created for the windows named in a trace */
+#define REPLAYWINS 4096
+
+static struct {
+    Window orig, win;
+} rwins[REPLAYWINS];
+
+static Window
+replaywin(Window orig, Window traceroot)
+{
+    unsigned long h, i;
+
+    if (orig == None || orig == PointerRoot)
+        return orig;
+    if (orig == traceroot)
+        return root;
+    for (i = 0, h = (orig * 2654435761u) % REPLAYWINS; i < REPLAYWINS;
+         i++, h = (h + 1) % REPLAYWINS) {
+        if (rwins[h].orig == orig)
+            return rwins[h].win;
+        if (rwins[h].orig == None) {
+            /* Created unmapped, the trace decides when it maps */
+            rwins[h].orig = orig;
+            rwins[h].win = XCreateSimpleWindow(dpy, root, 0, 0, 640, 480, 0, 0, 0);
+            return rwins[h].win;
         }
-        XFree(wins);
+    }
+    wm_log("Replay: more than %d windows in the trace\n", REPLAYWINS);
+    return None;
+}
+
+/* Point the windows of a recorded event at their stand-ins */
+static void
+replayevent(XEvent *ev, const WMTraceRecord *r, Window traceroot)
+{
+    ev->xany.display = dpy;
+    ev->xany.window = replaywin(ev->xany.window, traceroot);
+    switch (ev->type) {
+    case KeyPress: case KeyRelease:
+        ev->xkey.keycode = XKeysymToKeycode(dpy, r->keysym);
+        /* fallthrough */
+    case ButtonPress: case ButtonRelease: case MotionNotify:
+    case EnterNotify: case LeaveNotify:
+        ev->xkey.root = root;
+        ev->xkey.subwindow = replaywin(ev->xkey.subwindow, traceroot);
+        break;
+    case MapRequest:
+        ev->xmaprequest.window = replaywin(ev->xmaprequest.window, traceroot);
+        break;
+    case ConfigureRequest:
+        ev->xconfigurerequest.window = replaywin(ev->xconfigurerequest.window, traceroot);
+        ev->xconfigurerequest.above = replaywin(ev->xconfigurerequest.above, traceroot);
+        break;
+    case ConfigureNotify:
+        ev->xconfigure.window = replaywin(ev->xconfigure.window, traceroot);
+        ev->xconfigure.above = replaywin(ev->xconfigure.above, traceroot);
+        break;
+    case DestroyNotify: case UnmapNotify: case MapNotify:
+        /* window follows event in all three structures */
+        ev->xdestroywindow.window = replaywin(ev->xdestroywindow.window, traceroot);
+        break;
+    }
+}
+
+/* Requests per event of each handler in a previous replay report */
+static int
+readbaseline(const char *path, double *base)
+{
+    char line[256], name[32];
+    unsigned long events;
+    double avg, max, req;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        fprintf(stderr, "wm: cannot open baseline %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%31s %lu %lf %lf %lf", name, &events, &avg, &max, &req) != 5)
+            continue;
+        for (int i = 0; i <= LASTEvent; i++)
+            if (!strcmp(eventname(i), name))
+                base[i] = req;
+    }
+    fclose(f);
+    return 1;
+}
+
+/* Feed a recorded trace through the handlers and report their cost.
+ * Returns non-zero when a handler issues more requests per event than in
+ * the baseline report. */
+static int
+replay(const char *path, const char *baseline)
+{
+    WMTraceHeader h;
+    WMTraceRecord r;
+    XEvent ev, discard;
+    double base[LASTEvent + 1];
+    unsigned long n = 0;
+    int i, failed = 0;
+    FILE *f = fopen(path, "rb");
+
+    if (!f) {
+        fprintf(stderr, "wm: cannot open trace %s: %s\n", path, strerror(errno));
+        return 2;
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != WMTRACE_MAGIC ||
+        h.version != WMTRACE_VERSION) {
+        fprintf(stderr, "wm: %s is not a version %d trace\n", path, WMTRACE_VERSION);
+        fclose(f);
+        return 2;
+    }
+    for (i = 0; i <= LASTEvent; i++)
+        base[i] = -1;
+    if (baseline && !readbaseline(baseline, base)) {
+        fclose(f);
+        return 2;
     }
 
-    /* Final arrange after adoption */
-    arrange();
+    memset(hstats, 0, sizeof(hstats));
+    while (running && fread(&r, sizeof(r), 1, f) == 1) {
+        memset(&ev, 0, sizeof(ev));
+        if (r.len > sizeof(ev) || fread(&ev, r.len, 1, f) != 1) {
+            fprintf(stderr, "wm: %s is truncated after %lu events\n", path, n);
+            break;
+        }
+        replayevent(&ev, &r, h.root);
+        handleevent(&ev);
+        n++;
+
+        /* The trace already holds everything the server reported */
+        if (ev.type == DestroyNotify)
+            XDestroyWindow(dpy, ev.xdestroywindow.window);
+        XSync(dpy, False);
+        while (XPending(dpy))
+            XNextEvent(dpy, &discard);
+    }
+    fclose(f);
+
+    printf("%-18s %9s %9s %9s %9s\n", "event", "events", "avg_us", "max_us", "req/event");
+    for (i = 0; i <= LASTEvent; i++) {
+        HandlerStat *hs = &hstats[i];
+        double req;
+
+        if (!hs->events)
+            continue;
+        req = (double)hs->requests / hs->events;
+        printf("%-18s %9lu %9.1f %9.1f %9.2f", eventname(i), hs->events,
+               hs->total_ms * 1e3 / hs->events, hs->max_ms * 1e3, req);
+        if (base[i] >= 0 && req > base[i] + 0.005) {
+            printf("  REGRESSION, baseline %.2f", base[i]);
+            failed = 1;
+        }
+        printf("\n");
+    }
+    printf("%lu events replayed from %s\n", n, path);
+    return failed;
 }
 
 int
-main(void)
+main(int argc, char *argv[])
 {
-    XEvent ev;
+    sigset_t mask;
+    struct pollfd pfd[4];
+    const char *tracepath = NULL, *baseline = NULL;
+    int opt, status = 0;
+
+    while ((opt = getopt(argc, argv, "r:b:")) != -1) {
+        switch (opt) {
+        case 'r': tracepath = optarg; break;
+        case 'b': baseline = optarg; break;
+        default:
+            fprintf(stderr, "usage: wm [-r trace [-b baseline]]\n");
+            return 2;
+        }
+    }
+    replaying = tracepath != NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &starttime);
 
     /* Set up logging */
     char logpath[256];
@@ -1154,6 +5606,8 @@ main(void)
 
     char logfile_path[512];
     snprintf(logfile_path, sizeof(logfile_path), "%s/wm.log", logpath);
+    snprintf(statspath, sizeof(statspath), "%s/wm.stats", logpath);
+    snprintf(sessionpath, sizeof(sessionpath), "%s/session", logpath);
     logfile = fopen(logfile_path, "a");
     if (!logfile) {
         fprintf(stderr, "Cannot open log file: %s\n", strerror(errno));
@@ -1162,6 +5616,17 @@ main(void)
 
     wm_log("Starting window manager\n");
 
+    /* Children and stats requests are handled from the event loop */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        wm_log("Cannot create signalfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    reap();  /* Children left over from before a reload */
+
     if (!(dpy = XOpenDisplay(NULL))) {
         wm_log("Cannot open display\n");
         exit(1);
@@ -1170,12 +5635,46 @@ main(void)
     /* Initialize clipboard atoms */
     clipboard = XInternAtom(dpy, "CLIPBOARD", False);
     primary_selection = XInternAtom(dpy, "PRIMARY", False);
+    XInternAtoms(dpy, (char **)atomnames, AtomLast, False, atom);
+    compilerules();
+
+    /* Held keys repeat presses without releases in between */
+    Bool detectable;
+    if (!XkbSetDetectableAutoRepeat(dpy, True, &detectable) || !detectable)
+        wm_log("Detectable auto-repeat not supported, key repeats look like new presses\n");
+
+    /* The xcb side of the same connection pipelines property and attribute
+     * reads, ordered with what Xlib sends; Xlib keeps the event queue */
+    xc = XGetXCBConnection(dpy);
 
     wm_log("Display opened successfully\n");
 
     screen = DefaultScreen(dpy);
     root = RootWindow(dpy, screen);
     XGetWindowAttributes(dpy, root, &attr);
+#ifdef XRANDR
+    int rrerrbase, major, minor;
+    if (XRRQueryExtension(dpy, &rrevbase, &rrerrbase) &&
+        XRRQueryVersion(dpy, &major, &minor) &&
+        (major > 1 || (major == 1 && minor >= 3))) {
+        xrandr = 1;
+        XRRSelectInput(dpy, root, RRScreenChangeNotifyMask |
+                       RRCrtcChangeNotifyMask | RROutputChangeNotifyMask);
+    }
+#endif
+    setupbar();
+    updategeom();
+    setupstate();
+    setupcgroups();
+#ifdef XFIXES
+    setupclipboard();
+#endif
+#ifdef XRES
+    setupxres();
+#endif
+#ifdef XDAMAGE
+    setupdamage();
+#endif
 
     /* Set up key bindings */
     for (long unsigned int i = 0; i < sizeof(keys)/sizeof(keys[0]); i++)
@@ -1184,28 +5683,102 @@ main(void)
                 GrabModeAsync, GrabModeAsync);
 
     /* Select events */
+    setupwatchdog();
     XSetErrorHandler(xerror);
+    /* Keys arrive through the passive grabs and pointer events through
+     * the drag grab, so typing and mouse movement never wake us */
     XSelectInput(dpy, root, SubstructureRedirectMask | SubstructureNotifyMask |
-                           ButtonPressMask | ButtonReleaseMask | PointerMotionMask |
-                           EnterWindowMask);
+                           StructureNotifyMask);
     XSync(dpy, False);
 
-    wm_log("Entering event loop\n");
-
     scan();
-    adopt_windows();  /* Add this line after scan() */
+    if (!clients)
+        restoresession();
+    updateweights();
+
+    if (replaying) {
+        wm_log("Replaying %s\n", tracepath);
+        status = replay(tracepath, baseline);
+        running = 0;
+    } else {
+        setuptrace();
+        wm_log("Entering event loop\n");
+    }
+
+    /* Start the scratchpad hidden so even the first toggle is instant */
+    if (running && SCRATCHPAD_PRELAUNCH && !scratch) {
+        spawn(scratchpadcmd);
+        scratchlaunched = 1;
+    }
 
     /* Main event loop */
-    while (running && !XNextEvent(dpy, &ev)) {
-        wm_log("Processing event: %d\n", ev.type);
-        if (handler[ev.type])
-            handler[ev.type](&ev);
+    pfd[0].fd = ConnectionNumber(dpy);
+    pfd[0].events = POLLIN;
+    pfd[1].fd = sigfd;
+    pfd[1].events = POLLIN;
+    pfd[2].fd = -1;             /* Resource accounting timer */
+    pfd[2].events = POLLIN;
+    pfd[3].fd = -1;             /* Redraw monitor timer */
+    pfd[3].events = POLLIN;
+#ifdef XRES
+    pfd[2].fd = xrestimer;
+#endif
+#ifdef XDAMAGE
+    pfd[3].fd = damagetimer;
+#endif
+    while (running) {
+        dispatchpending();
+        if (!running)
+            break;
+        if (poll(pfd, 4, sessiontimeout()) < 0 && errno != EINTR) {
+            wm_log("poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (sessiondue || restoreend) {
+            watchbegin("session", 0);
+            sessiontick();
+            watchend();
+        }
+        if (pfd[0].revents & POLLIN)
+            wakeups++;
+        if (pfd[1].revents & POLLIN) {
+            watchbegin("signals", 0);
+            readsignals();
+            watchend();
+        }
+#ifdef XRES
+        if (pfd[2].revents & POLLIN) {
+            watchbegin("xres", 0);
+            xrestick();
+            watchend();
+        }
+#endif
+#ifdef XDAMAGE
+        if (pfd[3].revents & POLLIN) {
+            watchbegin("damage", 0);
+            damagetick();
+            watchend();
+        }
+#endif
+        if (pfd[0].revents & (POLLERR | POLLHUP)) {
+            wm_log("Lost connection to the X server\n");
+            break;
+        }
     }
 
     wm_log("Exiting event loop\n");
+    thawall();  /* Also after losing the server, nothing else would resume them */
+    if (!replaying)
+        writestats();
     /* Clean up */
+    if (tracefp)
+        fclose(tracefp);
+    if (statepage) {
+        munmap(statepage, sizeof(WMState));
+        shm_unlink(statename);
+    }
     XCloseDisplay(dpy);
     if (logfile)
         fclose(logfile);
-    return 0;
+    return status;
 }
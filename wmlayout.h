@@ -0,0 +1,42 @@
+#ifndef WMLAYOUT_H
+#define WMLAYOUT_H
+
+#include <stdint.h>
+
+/* Layout plugin ABI.
+ *
+ * A layout is a shared object exporting
+ *
+ *     const WMLayout wm_layout = { WMLAYOUT_ABI, "name", arrange };
+ *
+ * and is loaded with dlopen() when a workspace switches to it. arrange()
+ * is given the number of tiled windows of the workspace, master first,
+ * and fills one rectangle per window. Rectangles are window geometry as
+ * passed to XMoveResizeWindow: x/y of the outer corner, w/h without the
+ * border, so a layout subtracts 2 * border from sizes itself.
+ *
+ * arrange() must not keep pointers to its arguments or call back into the
+ * window manager; it may be unloaded and replaced at any time between
+ * calls. The ABI number changes whenever these structures change. */
+
+#define WMLAYOUT_ABI 1
+
+typedef struct {
+    int32_t x, y, w, h;
+} WMRect;
+
+typedef struct {
+    int32_t n;                  /* Tiled windows to place, at least 1 */
+    WMRect area;                /* Work area of the monitor */
+    float mfact;                /* Master area ratio, 0.1-0.9 */
+    int32_t gap;                /* Gap between windows and the area edges */
+    int32_t border;             /* Border width of each window */
+} WMLayoutParams;
+
+typedef struct {
+    uint32_t abi;               /* WMLAYOUT_ABI the plugin was built against */
+    const char *name;
+    void (*arrange)(const WMLayoutParams *p, WMRect *out);
+} WMLayout;
+
+#endif /* WMLAYOUT_H */
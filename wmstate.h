@@ -0,0 +1,77 @@
+#ifndef WMSTATE_H
+#define WMSTATE_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Shared-memory state page published by the window manager.
+ *
+ * The page is a POSIX shm object named "/wm-state.<uid>.<display>"
+ * (e.g. /dev/shm/wm-state.1000.0 for DISPLAY=:0).  Panels and scrapers
+ * mmap it read-only and take snapshots with wmstate_read(), which costs
+ * no syscalls and never wakes the window manager.
+ *
+ * The writer follows a seqlock protocol: seq is odd while an update is
+ * in progress and is bumped to the next even value once it is complete. */
+
+#define WMSTATE_MAGIC      0x776d7374u  /* "wmst" */
+#define WMSTATE_VERSION    3
+#define WMSTATE_WORKSPACES 10           /* Slot 0 unused, workspaces are 1-9 */
+#define WMSTATE_MONITORS   8            /* Outputs beyond this are not managed */
+#define WMSTATE_XRES_TOP   8            /* Largest X clients by pixmap memory */
+
+typedef struct {
+    int32_t x, y, w, h;                    /* Output geometry */
+    int32_t workspace;                     /* Workspace shown on the output */
+    uint32_t wincount[WMSTATE_WORKSPACES]; /* Windows per workspace of the output */
+} WMStateMonitor;
+
+typedef struct {
+    uint64_t window;                       /* First managed window, 0 if none */
+    uint64_t pixmap_bytes;
+    int32_t pid;                           /* 0 if unknown */
+    uint32_t windows;                      /* Windows of the X client, managed or not */
+} WMStateXRes;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;                          /* Odd while being written */
+    uint32_t size;                         /* sizeof(WMState) of the writer */
+    int32_t current_workspace;             /* Workspace of the selected output */
+    uint32_t nclients;
+    uint32_t wincount[WMSTATE_WORKSPACES]; /* Managed windows per workspace, all outputs */
+    uint64_t focused;                      /* Focused X window, 0 if none */
+    uint32_t focused_fullscreen;
+    uint32_t pad;
+    uint64_t updates;                      /* Number of published updates */
+    uint32_t nmonitors;
+    uint32_t selmon;                       /* Index of the selected output */
+    WMStateMonitor mon[WMSTATE_MONITORS];
+    /* X-Resource accounting, zero when the server lacks the extension */
+    uint64_t xres_samples;
+    uint64_t pixmap_bytes[WMSTATE_WORKSPACES]; /* Pixmap memory charged per workspace */
+    uint32_t xwindows[WMSTATE_WORKSPACES];     /* X windows charged per workspace */
+    uint32_t nxres;                        /* Entries used in xres */
+    uint32_t pad2;
+    WMStateXRes xres[WMSTATE_XRES_TOP];    /* Largest pixmap users, largest first */
+} WMState;
+
+/* Copy a consistent snapshot of page into snap.
+ * Returns 1 on success, 0 if the writer kept the page busy. */
+static inline int
+wmstate_read(const WMState *page, WMState *snap)
+{
+    for (int tries = 0; tries < 1000; tries++) {
+        uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        memcpy(snap, page, sizeof(*snap));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq)
+            return snap->magic == WMSTATE_MAGIC;
+    }
+    return 0;
+}
+
+#endif /* WMSTATE_H */
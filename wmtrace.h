@@ -0,0 +1,37 @@
+#ifndef WMTRACE_H
+#define WMTRACE_H
+
+#include <stdint.h>
+
+/* Binary event trace written when WM_TRACE names a file.
+ *
+ * The file starts with a WMTraceHeader, followed by one WMTraceRecord per
+ * event dispatched by the window manager.  Each record is followed by len
+ * bytes of the event itself: the type-specific Xlib event structure of the
+ * recording build, without padding up to sizeof(XEvent).  Traces are only
+ * meant to be replayed by the same build on the same architecture.
+ *
+ * Replay with "wm -r trace [-b baseline]" against a scratch server such as
+ * Xvfb. */
+
+#define WMTRACE_MAGIC   0x63727477u  /* "wtrc" */
+#define WMTRACE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t root;          /* Root window of the recording display */
+    uint32_t width, height; /* Root window size */
+    uint64_t start;         /* CLOCK_REALTIME seconds at recording start */
+} WMTraceHeader;
+
+typedef struct {
+    uint64_t time_ns;       /* Since recording start, continues across reloads */
+    uint32_t dur_ns;        /* Time spent in the handler */
+    uint32_t requests;      /* X requests issued by the handler */
+    uint32_t keysym;        /* Keysym of key events, keycodes differ per server */
+    uint16_t type;          /* X event type */
+    uint16_t len;           /* Event bytes that follow */
+} WMTraceRecord;
+
+#endif /* WMTRACE_H */